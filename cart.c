@@ -1,14 +1,23 @@
 // Tic-Tac-Toe fuer Gameboy
 // mit dem sdcc-Compiler
 
+// Mit -DHOST uebersetzt laeuft dieselbe Logik auf dem PC ("make host"):
+// Register und VRAM sind dann ein Array in host.c, HW() rechnet die
+// Adressen dorthin um, die Assembler-Routinen haben C-Gegenstuecke.
+#ifdef HOST
+#include "host.h"
+#define main cart_main
+#else
+#define HW(a) (a)
+#define HW_ADDR(p) ((unsigned int)(p))
+#endif
+
+// sprite_t, die Joypad-Bits und was host.c von hier aufruft
+#include "cart.h"
+
 typedef unsigned char tile_t[16];
 typedef unsigned char map_row_t[32];
 
-// Struktur fuer Sprite-Daten (4 Byte)
-typedef struct {
-  unsigned char y, x, tile, flags;
-} sprite_t;
-
 // Konstanten fuer die GB-Hardware
 
 // Paletten
@@ -18,29 +27,66 @@ typedef struct {
 #define PAL_BLACK 0xff
 
 // Register fuer Background- und Window-Position
-#define BGPOSY ((unsigned char*)0xff42)
-#define BGPOSX ((unsigned char*)0xff43)
-#define WNDPOSY ((unsigned char*)0xff4a)
-#define WNDPOSX ((unsigned char*)0xff4b)
+#define BGPOSY ((unsigned char*)HW(0xff42))
+#define BGPOSX ((unsigned char*)HW(0xff43))
+#define WNDPOSY ((unsigned char*)HW(0xff4a))
+#define WNDPOSX ((unsigned char*)HW(0xff4b))
 
 // Register fuer buttons
-#define BUTTONS ((unsigned char*)0xff00)
+#define BUTTONS ((volatile unsigned char*)HW(0xff00))
 
 // Paletten, LCD-Controller, Maps, Tiles, Sprites...
 // (siehe http://marc.rawer.de/Gameboy/Docs/GBCPUman.pdf)
-#define BGPAL ((unsigned char*)0xff47)
-#define SPRITEPAL0 ((unsigned char*)0xff48)
-#define SPRITEPAL1 ((unsigned char*)0xff49)
-#define LCDCONT ((volatile unsigned char*)0xff40)
-#define LCDSTAT ((volatile unsigned char*)0xff41)
-#define LO_MAP ((map_row_t*)0x9800)
-#define HI_MAP ((map_row_t*)0x9c00)
-#define LO_TILES ((tile_t*)0x8000)
-#define HI_TILES ((tile_t*)0x8c00)
-#define SPRITES ((sprite_t *)0xfe00)
-
-// Interrupt-Enable-Register
-#define IRQEN ((unsigned char *)0xffff)
+#define BGPAL ((unsigned char*)HW(0xff47))
+#define SPRITEPAL0 ((unsigned char*)HW(0xff48))
+#define SPRITEPAL1 ((unsigned char*)HW(0xff49))
+#define LCDCONT ((volatile unsigned char*)HW(0xff40))
+#define LCDSTAT ((volatile unsigned char*)HW(0xff41))
+#define LY ((volatile unsigned char*)HW(0xff44))
+#define LO_MAP ((map_row_t*)HW(0x9800))
+#define HI_MAP ((map_row_t*)HW(0x9c00))
+#define LO_TILES ((tile_t*)HW(0x8000))
+#define HI_TILES ((tile_t*)HW(0x8c00))
+#define SPRITES ((sprite_t *)HW(0xfe00))
+
+// Schatten-OAM im WRAM (header.asm), wird in jedem VBlank per DMA
+// nach SPRITES kopiert und kann daher jederzeit beschrieben werden
+#ifdef HOST
+sprite_t shadow_oam[40];
+#endif
+void init_oam_dma(void);
+void oam_dma(void);
+
+// Der Zustand, der in jedem Frame gebraucht wird, liegt im HRAM
+// (header.asm, ab 0xff80). Als __sfr deklariert greift sdcc darauf mit
+// ldh zu: 2 Byte und 12 Takte statt 3 Byte und 16 Takte bei ld a,(nn).
+// Das geht nur fuer 8-Bit-Werte; wie das WRAM ist das HRAM beim
+// Einschalten nicht geloescht. "make verify" prueft Adressen (cart.noi)
+// und ldh-Zugriffe (cart.asm), neue Variablen auch in HRAMSYMS eintragen.
+extern volatile __sfr frame_count;
+extern volatile __sfr vq_head, vq_tail;
+extern volatile __sfr blit_rows;
+extern volatile __sfr bg_flip_pending;
+extern __sfr scroll_x, scroll_y;
+extern __sfr char_pos_x, char_pos_y;
+extern volatile __sfr joy_state, joy_pressed, joy_released;
+extern volatile __sfr joy_head, joy_tail;
+
+// Timer: DIV zaehlt mit 16384 Hz, also alle 256 CPU-Takte eins weiter
+#define DIV ((volatile unsigned char *)HW(0xff04))
+
+// Interrupt-Enable- und Interrupt-Flag-Register
+#define IRQEN ((volatile unsigned char *)HW(0xffff))
+#define IRQFLAGS ((volatile unsigned char *)HW(0xff0f))
+
+// Bits in IRQEN/IRQFLAGS
+enum IRQ_BIT {
+  IRQ_VBLANK = 0x01,
+  IRQ_LCDSTAT = 0x02,
+  IRQ_TIMER = 0x04,
+  IRQ_SERIAL = 0x08,
+  IRQ_JOYPAD = 0x10
+};
 
 // Bits im LCD-Controller-Register
 enum LCDCONT_BIT {
@@ -103,95 +149,884 @@ void wait_for_hblank() { while ((*LCDSTAT & 3) != 0); }
 void wait_for_vblank_end() { while ((*LCDSTAT & 3) == 1); }
 void wait_for_hblank_end() { while ((*LCDSTAT & 3) == 0); }
 
-void set_tile_on_vblank(int x, int y, unsigned char t) {
-  wait_for_vblank();
-  LO_MAP[y][x] = t;
+// CPU anhalten, bis ein Interrupt (VBlank oder Joypad) auftritt -
+// statt LCDSTAT in einer Schleife abzufragen
+#ifndef HOST
+void halt_cpu(void) {
+  __asm
+    halt
+    nop
+  __endasm;
+}
+#else
+// Auf dem PC: bis zum naechsten Interrupt vorspulen (host.c)
+void halt_cpu(void) {
+  host_halt();
 }
+#endif
 
-// Hilfsfunktionen fuer log2, Modulo, Integer-Division und -Multiplikation
-int log2(int s) {
-  int i = 0;
+// Interrupts sperren und wieder freigeben: Was dazwischen geschrieben
+// wird, sieht der VBlank-Interrupt nur ganz oder gar nicht
+#ifndef HOST
+void irq_off(void) {
+  __asm
+    di
+  __endasm;
+}
 
-  while (s) {
-    s = s >> 1;
-    if (s) i = i + 1;
-  }
+void irq_on(void) {
+  __asm
+    ei
+  __endasm;
+}
+#else
+// Auf dem PC laeuft der Interrupt nur in halt_cpu()
+void irq_off(void) {}
+void irq_on(void) {}
+#endif
 
-  return i;
+// Doppelpuffer fuer den Hintergrund: Angezeigt wird LO_MAP oder HI_MAP
+// (bg_front = 0/1). Alle Ausgaben gehen in die Map bg_draw - normalerweise
+// die angezeigte, nach bg_compose() die unsichtbare. bg_flip() schaltet
+// dann im VBlank mit einem einzigen LCDCONT-Zugriff um. Das Window (nur
+// in den m,n,k-Modi an) zeigt immer dieselbe Map wie der Hintergrund.
+map_row_t *bg_draw;
+unsigned char bg_front;
+
+// Warteschlange fuer Schreibzugriffe auf die Tile-Map (Ringpuffer im WRAM)
+// Jeder Eintrag belegt 4 Byte: Adresse (lo, hi), Tile, unbenutzt.
+// Mit 64 Eintraegen ist der Puffer genau 256 Byte gross, die Indizes
+// vq_head/vq_tail (im HRAM) sind Byte-Offsets und laufen von selbst ueber.
+// set_tile_on_vblank() haengt hinten an, der VBlank-Interrupt
+// (vq_drain) arbeitet so viele Eintraege ab, wie in die VBlank-Phase passen.
+unsigned char vq_buf[256];
+
+// Tile t an Pos. x/y setzen - bei abgeschaltetem LCD direkt, sonst
+// ueber die Warteschlange im naechsten VBlank
+void set_tile_on_vblank(int x, int y, unsigned char t) {
+  unsigned char *p = &bg_draw[y][x];
+  unsigned char h;
+
+  if (!(*LCDCONT & LCD_ENABLE)) { *p = t; return; }
+
+  // Puffer voll? Dann warten, bis der VBlank-Interrupt Platz geschaffen hat
+  h = vq_head;
+  while ((unsigned char)(h + 4) == vq_tail) halt_cpu();
+
+  vq_buf[h] = HW_ADDR(p) & 0xff;
+  vq_buf[h + 1] = HW_ADDR(p) >> 8;
+  vq_buf[h + 2] = t;
+  vq_head = h + 4;
 }
 
-int _div(int a, int b, int *r) {
-  int i, q;
+// Warteschlange abarbeiten (aus dem VBlank-Interrupt aufgerufen)
+// Vor jedem Schreibzugriff wird geprueft, ob der LCD-Controller noch
+// im VBlank (Modus 1) ist - danach ist das VRAM nicht mehr sicher zugreifbar,
+// der Rest bleibt fuer den naechsten VBlank in der Warteschlange.
+#ifndef HOST
+void vq_drain(void) __naked {
+  __asm
+    ld a, (_vq_head)
+    ld b, a
+    ld a, (_vq_tail)
+    ld c, a
+1$:
+    ld a, c
+    cp b
+    jr z, 2$            ; Warteschlange leer
+    ldh a, (0x41)       ; LCDSTAT
+    and #3
+    dec a
+    jr nz, 2$           ; nicht mehr im VBlank
+    ld hl, #_vq_buf
+    ld e, c
+    ld d, #0
+    add hl, de
+    ld a, (hl+)
+    ld e, a
+    ld a, (hl+)
+    ld d, a
+    ld a, (hl)
+    ld (de), a
+    ld a, c
+    add a, #4
+    ld c, a
+    jr 1$
+2$:
+    ld a, c
+    ld (_vq_tail), a
+    ret
+  __endasm;
+}
+#else
+// Auf dem PC dauert der VBlank beliebig lange
+void vq_drain(void) {
+  unsigned char t = vq_tail;
+
+  for (; t != vq_head; t += 4)
+    *HW(vq_buf[t] | (vq_buf[t + 1] << 8)) = vq_buf[t + 2];
+  vq_tail = t;
+}
+#endif
 
-  int la = log2(a), lb = log2(b), ldiff = la - lb;
+// Hilfsfunktionen fuer Multiplikation, Division und Modulo
+// Die GB-CPU kann weder multiplizieren noch dividieren. Alle Funktionen
+// arbeiten mit 8-Bit-Werten ohne Vorzeichen und haben feste Kosten:
+// die Schleifen laufen immer genau 8 Mal, unabhaengig von den Operanden,
+// Tabellenzugriffe (pixel_to_cell) kommen ganz ohne aus.
+
+// 8x8 -> 16 Bit Multiplikation (Schieben und Addieren, 8 Schritte)
+unsigned int mul8(unsigned char a, unsigned char b) {
+  unsigned int p = 0, m = b;
+  unsigned char i;
+
+  for (i = 0; i < 8; i++) {
+    if (a & 1) p += m;
+    a >>= 1;
+    m <<= 1;
+  }
 
-  for (i = 16 - ldiff, q = 0; i <= 16; i++) {
-    int x = b << (16 - i), qx = 1 << (16 - i);
+  return p;
+}
 
-    if (a >= x) {
-      q = q + qx;
-      a = a - x;
+// Division mit Rest (schriftliche Division im Binaersystem, 8 Schritte)
+// Rest in *r, wenn r != 0; Division durch 0 liefert 0xff. Braucht nur
+// die Profiler-Zeile, im normalen ROM fehlt sie (der Host testet sie).
+#if defined(PROFILE) || defined(HOST)
+unsigned char divmod8(unsigned char a, unsigned char b, unsigned char *r) {
+  unsigned int rem = 0;
+  unsigned char q = 0, i;
+
+  for (i = 0; i < 8; i++) {
+    rem = (rem << 1) | (a >> 7);
+    a <<= 1;
+    q <<= 1;
+    if (rem >= b) {
+      rem -= b;
+      q |= 1;
     }
   }
 
-  if (r != (int *)0) *r = a; // Rest
+  if (r) *r = rem;
 
   return q; // Quotient
 }
 
-int div(int a, int b) {
-  int r;
-  return _div(a, b, &r);
+unsigned char div8(unsigned char a, unsigned char b) {
+  return divmod8(a, b, 0);
 }
 
-int mod(int a, int b) {
-  int r;
-  _div(a, b, &r);
+unsigned char mod8(unsigned char a, unsigned char b) {
+  unsigned char r;
+  divmod8(a, b, &r);
   return r;
 }
+#endif
 
-int mul(int a, int b) {
-  int p = 0;
+// Umrechnung Pixel -> Feld fuer den Cursor: Index ist der Abstand
+// zum linken bzw. oberen Rand des Spielfelds (x-45 bzw. y-37) als
+// 8-Bit-Wert ohne Vorzeichen, ein Feld ist 28 Pixel breit.
+// Negative Abstaende landen so am Ende der Tabelle (0xff = kein Feld).
+const unsigned char pixel_to_cell[256] = {
+  // 0..27: Spalte/Zeile 0
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  // 28..55: Spalte/Zeile 1
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  // 56..83: Spalte/Zeile 2
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  // 84..255: ausserhalb des Spielfelds
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+// Kopieren und Fuellen fuer init() (und alles andere bei abgeschaltetem
+// LCD): Erst der Rest (0-7 Byte) einzeln, dann 8 Byte pro Durchlauf
+// abgerollt. Kopieren kostet so 26 Takte pro Byte, Fuellen 10 - die
+// Schleifen in C brauchen ein Vielfaches. Der Blockzaehler steht in bc,
+// c wird bei jedem Block heruntergezaehlt, b nur alle 256 Bloecke.
+unsigned char *mem_dst;
+const unsigned char *mem_src;
+unsigned int mem_len;
+unsigned char mem_val;
+
+#ifndef HOST
+void copy_asm(void) __naked {
+  __asm
+    ld a, (_mem_src)
+    ld e, a
+    ld a, (_mem_src + 1)
+    ld d, a               ; de = Quelle
+    ld a, (_mem_dst)
+    ld l, a
+    ld a, (_mem_dst + 1)
+    ld h, a               ; hl = Ziel
+    ld a, (_mem_len + 1)
+    ld b, a
+    ld a, (_mem_len)
+    ld c, a
+    and #7
+    jr z, 2$
+    push bc
+    ld b, a
+1$:
+    ld a, (de)            ; Rest einzeln
+    inc de
+    ld (hl+), a
+    dec b
+    jr nz, 1$
+    pop bc
+2$:
+    srl b                 ; bc = Anzahl 8-Byte-Bloecke
+    rr c
+    srl b
+    rr c
+    srl b
+    rr c
+    ld a, b
+    or c
+    ret z
+    ld a, c
+    or a
+    jr z, 3$
+    inc b
+3$:
+    ld a, (de)
+    inc de
+    ld (hl+), a
+    ld a, (de)
+    inc de
+    ld (hl+), a
+    ld a, (de)
+    inc de
+    ld (hl+), a
+    ld a, (de)
+    inc de
+    ld (hl+), a
+    ld a, (de)
+    inc de
+    ld (hl+), a
+    ld a, (de)
+    inc de
+    ld (hl+), a
+    ld a, (de)
+    inc de
+    ld (hl+), a
+    ld a, (de)
+    inc de
+    ld (hl+), a
+    dec c
+    jr nz, 3$
+    dec b
+    jr nz, 3$
+    ret
+  __endasm;
+}
 
-  while (a) {
-    if (a & 1) p = p + b;
-    a = a >> 1;
-    b = b << 1;
+void fill_asm(void) __naked {
+  __asm
+    ld a, (_mem_dst)
+    ld l, a
+    ld a, (_mem_dst + 1)
+    ld h, a               ; hl = Ziel
+    ld a, (_mem_val)
+    ld e, a               ; e = Fuellwert
+    ld a, (_mem_len + 1)
+    ld b, a
+    ld a, (_mem_len)
+    ld c, a
+    and #7
+    jr z, 2$
+    ld d, a
+    ld a, e
+1$:
+    ld (hl+), a           ; Rest einzeln
+    dec d
+    jr nz, 1$
+2$:
+    srl b                 ; bc = Anzahl 8-Byte-Bloecke
+    rr c
+    srl b
+    rr c
+    srl b
+    rr c
+    ld a, b
+    or c
+    ret z
+    ld a, c
+    or a
+    jr z, 3$
+    inc b
+3$:
+    ld a, e
+4$:
+    ld (hl+), a
+    ld (hl+), a
+    ld (hl+), a
+    ld (hl+), a
+    ld (hl+), a
+    ld (hl+), a
+    ld (hl+), a
+    ld (hl+), a
+    dec c
+    jr nz, 4$
+    dec b
+    jr nz, 4$
+    ret
+  __endasm;
+}
+#else
+void copy_asm(void) {
+  for (; mem_len; mem_len--) *mem_dst++ = *mem_src++;
+}
+
+void fill_asm(void) {
+  for (; mem_len; mem_len--) *mem_dst++ = mem_val;
+}
+#endif
+
+// len Byte von src nach dst kopieren (VRAM nur bei abgeschaltetem LCD)
+void mem_copy(unsigned char *dst, const unsigned char *src, unsigned int len) {
+  mem_dst = dst;
+  mem_src = src;
+  mem_len = len;
+  copy_asm();
+}
+
+// len Byte ab dst mit v fuellen (VRAM nur bei abgeschaltetem LCD)
+void mem_fill(unsigned char *dst, unsigned char v, unsigned int len) {
+  mem_dst = dst;
+  mem_val = v;
+  mem_len = len;
+  fill_asm();
+}
+
+// Aus tile.til generierte Daten (tiles.asm, wird direkt dazugelinkt):
+// tiles       - nur die definierten Tiles, identische zusammengefasst
+//               (mit "convtiles -z" statt dessen gepackt in tiles_packed,
+//               das Makefile definiert dann TILES_PACKED)
+// tiles_count - Anzahl der Tiles in tiles
+// tiles_map   - Tile-Name (ASCII-Code) -> Tile-Nummer im Tile-Speicher
+extern const unsigned char tiles_count;
+#ifdef TILES_PACKED
+extern const unsigned char tiles_packed[];
+#else
+extern const tile_t tiles[];
+#endif
+extern const unsigned char tiles_map[256];
+
+// Bildschirmvorlagen aus tiles.til (fuer blit_map)
+extern const unsigned char tiles_board[];
+
+// Bildschirmvorlagen (in tiles.til mit "=" definiert) in die Tile-Map
+// kopieren. Eine Vorlage besteht aus Breite, Hoehe und den Tile-Nummern
+// Zeile fuer Zeile. Bei eingeschaltetem LCD kopiert der VBlank-Interrupt
+// (blit_drain) so viele ganze Zeilen, wie in die VBlank-Phase passen.
+const unsigned char *blit_src;
+unsigned char *blit_dst;
+unsigned char blit_w, blit_ly_max;
+
+// Eine Zeile kostet 40 Takte pro Tile plus etwa 70 Takte Verwaltung, bei
+// 20 Tiles also rund 870 Takte (knapp 2 Bildzeilen zu 456 Takten), bei 32
+// Tiles rund 1350. Eine Zeile wird nur begonnen, solange LY <= blit_ly_max
+// ist: 151 fuer bis zu 20 Tiles (noch 912 Takte VBlank), 149 fuer breitere
+// Zeilen (noch 1824). Nach Interrupt-Einsprung und OAM-DMA schafft ein
+// VBlank so etwa 4 Zeilen mit 20 Tiles, ein ganzer Bildschirm (20x18)
+// braucht also rund 5 Frames.
+#ifndef HOST
+void blit_drain(void) __naked {
+  __asm
+    ld a, (_blit_rows)
+    or a
+    ret z
+    ld c, a
+    ld a, (_blit_src)
+    ld l, a
+    ld a, (_blit_src + 1)
+    ld h, a               ; hl = Quelle
+    ld a, (_blit_dst)
+    ld e, a
+    ld a, (_blit_dst + 1)
+    ld d, a               ; de = Ziel in der Tile-Map
+1$:
+    ldh a, (0x44)         ; LY
+    cp #144
+    jr c, 3$              ; nicht in der VBlank-Phase
+    ld b, a
+    ld a, (_blit_ly_max)
+    cp b
+    jr c, 3$              ; LY > blit_ly_max: Zeile passt nicht mehr
+    ld a, (_blit_w)
+    ld b, a
+2$:
+    ld a, (hl+)
+    ld (de), a
+    inc de
+    dec b
+    jr nz, 2$
+    ld a, (_blit_w)       ; de += 32 - Breite: naechste Zeile
+    cpl
+    add a, #33
+    add a, e
+    ld e, a
+    ld a, d
+    adc a, #0
+    ld d, a
+    dec c
+    jr nz, 1$
+3$:
+    ld a, l
+    ld (_blit_src), a
+    ld a, h
+    ld (_blit_src + 1), a
+    ld a, e
+    ld (_blit_dst), a
+    ld a, d
+    ld (_blit_dst + 1), a
+    ld a, c
+    ld (_blit_rows), a
+    ret
+  __endasm;
+}
+#else
+void blit_drain(void) {
+  unsigned char i;
+
+  for (; blit_rows; blit_rows--, blit_dst += 32)
+    for (i = 0; i < blit_w; i++) blit_dst[i] = *blit_src++;
+}
+#endif
+
+// Vorlage scr an Pos. x/y der Tile-Map kopieren. Bei eingeschaltetem
+// LCD kehrt blit_map() gleich zurueck, fertig ist die Kopie, sobald
+// blit_rows 0 ist.
+void blit_map(const unsigned char *scr, unsigned char x, unsigned char y) {
+  const unsigned char *src = scr + 2;
+  unsigned char *dst = &bg_draw[y][x];
+  unsigned char w = scr[0], h = scr[1];
+
+  // LCD aus: direkt kopieren
+  if (!(*LCDCONT & LCD_ENABLE)) {
+    for (; h; h--, src += w, dst += 32) mem_copy(dst, src, w);
+    return;
   }
 
-  return p;
+  // Erst die Tile-Warteschlange abarbeiten lassen, damit aeltere
+  // Einzel-Tiles die Vorlage nicht ueberschreiben
+  while (vq_head != vq_tail) halt_cpu();
+
+  blit_src = src;
+  blit_dst = dst;
+  blit_w = w;
+  blit_ly_max = w > 20 ? 149 : 151;
+  blit_rows = h;   // zuletzt setzen: startet die Kopie im Interrupt
 }
 
-// Aus tile.til generiertes Array (in tiles.inc) importieren
-#include "tiles.inc"
+// Groessere Bloecke bei eingeschaltetem LCD ins VRAM kopieren, ohne auf
+// den VBlank-Interrupt angewiesen zu sein: Das VRAM ist nur in Mode 3
+// gesperrt. Nach dem Wechsel von Mode 3 nach Mode 0 bleiben die HBlank
+// und Mode 2 der naechsten Zeile (80 Takte). Mode 3 dauert bis zu 289
+// Takte (10 Sprites in der Zeile, Window, Fein-Scrolling), die HBlank
+// also mindestens 456 - 80 - 289 = 87 Takte: zusammen 167 Takte.
+// Schlimmstenfalls vom Wechsel nach Mode 0 bis zum letzten Schreiben:
+//   Erkennen in 5$ (Wechsel knapp nach dem Lesen)   32 Takte
+//   and, jr, ret                                    32 Takte
+//   4 Byte abgerollt, je 24 Takte                   96 Takte
+//                                                  160 Takte
+// 8 Byte (256 Takte) passten nur mit hoechstens einem Sprite pro Zeile.
+// Im VBlank (Zeile 144-151) wird ebenso kopiert, ohne auf Mode 3 zu
+// warten. Das sind etwa 600 Byte pro Frame.
+// Waehrend eines Blocks sind die Interrupts gesperrt, damit der
+// VBlank-Interrupt das Fenster nicht verkuerzt.
+unsigned char *vcopy_dst;
+const unsigned char *vcopy_src;
+unsigned int vcopy_len;
+
+#ifndef HOST
+void vram_copy_asm(void) __naked {
+  __asm
+    ld a, (_vcopy_src)
+    ld e, a
+    ld a, (_vcopy_src + 1)
+    ld d, a               ; de = Quelle
+    ld a, (_vcopy_dst)
+    ld l, a
+    ld a, (_vcopy_dst + 1)
+    ld h, a               ; hl = Ziel im VRAM
+    ld a, (_vcopy_len)
+    ld c, a
+    and #3
+    ld (_vcopy_len), a    ; Rest (0-3 Byte) fuer den Schluss
+    ld a, (_vcopy_len + 1)
+    ld b, a
+    srl b                 ; bc = Anzahl ganzer 4-Byte-Bloecke
+    rr c
+    srl b
+    rr c
+1$:
+    ld a, b
+    or c
+    jr z, 3$
+    dec bc
+    call 4$
+    ld a, (de)            ; 4 Byte, je 24 Takte
+    inc de
+    ld (hl+), a
+    ld a, (de)
+    inc de
+    ld (hl+), a
+    ld a, (de)
+    inc de
+    ld (hl+), a
+    ld a, (de)
+    inc de
+    ld (hl+), a
+2$:
+    ei
+    jr 1$
+3$:
+    ld a, (_vcopy_len)    ; Rest: Einsprung 3 * Rest Byte vor 2$
+    or a
+    ret z
+    ld c, a
+    add a, a
+    add a, c
+    cpl
+    inc a
+    add a, #<2$
+    ld c, a
+    ld a, #>2$
+    adc a, #0xff
+    ld b, a
+    push bc               ; Sprungziel fuer das ret am Ende von 4$
+    xor a
+    ld (_vcopy_len), a
+    ld b, a               ; danach keine Bloecke mehr
+    ld c, a
+4$:
+    ldh a, (0x41)         ; Auf ein sicheres Fenster warten, Interrupts an
+    and #3
+    cp #1
+    jr z, 6$              ; VBlank
+    cp #3
+    jr nz, 4$             ; Mode 0/2: Beginn der naechsten HBlank abwarten
+    di
+5$:
+    ldh a, (0x41)
+    and #3
+    jr nz, 5$             ; Mode 3 -> Mode 0
+    ret
+6$:
+    di
+    ldh a, (0x44)         ; LY
+    sub #144
+    cp #8
+    ret c                 ; Zeile 144-151: Block passt noch in den VBlank
+    ei
+    jr 4$
+  __endasm;
+}
+#else
+void vram_copy_asm(void) {
+  for (; vcopy_len; vcopy_len--) *vcopy_dst++ = *vcopy_src++;
+}
+#endif
 
-// Tile mit Nummer id an Pos x/y setzen
+// len Byte von src nach dst (im VRAM) kopieren, kehrt zurueck, wenn
+// alles kopiert ist. Wie bei blit_map() wird vorher die
+// Tile-Warteschlange abgearbeitet, damit die Reihenfolge stimmt.
+void vram_copy(unsigned char *dst, const unsigned char *src, unsigned int len) {
+  // LCD aus: direkt kopieren (LCDSTAT meldet dann immer Mode 0)
+  if (!(*LCDCONT & LCD_ENABLE)) {
+    mem_copy(dst, src, len);
+    return;
+  }
+
+  while (vq_head != vq_tail || blit_rows) halt_cpu();
+
+  vcopy_dst = dst;
+  vcopy_src = src;
+  vcopy_len = len;
+  vram_copy_asm();
+}
+
+// Ab jetzt in die unsichtbare Map zeichnen. Die Ausgaben laufen wie
+// sonst ueber die Warteschlange und duerfen sich ueber mehrere Frames
+// hinziehen - man sieht davon nichts bis zum bg_flip().
+void bg_compose(void) {
+  bg_draw = bg_front ? LO_MAP : HI_MAP;
+}
+
+// Die fertig gezeichnete Map anzeigen: Alle Ausgaben muessen schon im
+// VRAM angekommen sein (Warteschlange leer, blit_rows 0), umgeschaltet
+// wird im naechsten VBlank, dann ist bg_flip_pending wieder 0.
+// Schon ab jetzt wird wieder in die angezeigte Map gezeichnet.
+void bg_flip(void) {
+  bg_front ^= 1;
+  bg_draw = bg_front ? HI_MAP : LO_MAP;
+
+  if (!(*LCDCONT & LCD_ENABLE)) {
+    set_bg_map(bg_front);
+    set_window_map(bg_front);
+    return;
+  }
+
+  bg_flip_pending = 1;
+}
+
+// Mit "convtiles -z" gepackte Daten nach dst entpacken (nur bei
+// abgeschaltetem LCD, da auch aus dst zurueckgelesen wird)
+// Format der Kommandos siehe pack_tiles() in convtiles.c; convtiles
+// berechnet aus den Taktzyklen der Befehle hier die Dauer des Entpackens.
+unsigned char *unpack_dst;
+const unsigned char *unpack_src;
+
+#ifndef HOST
+void unpack_asm(void) __naked {
+  __asm
+    ld a, (_unpack_src)
+    ld l, a
+    ld a, (_unpack_src + 1)
+    ld h, a               ; hl = Quelle
+    ld a, (_unpack_dst)
+    ld e, a
+    ld a, (_unpack_dst + 1)
+    ld d, a               ; de = Ziel
+1$:
+    ld a, (hl+)           ; Kommando
+    or a
+    ret z                 ; 0x00: Ende
+    bit 7, a
+    jr nz, 3$
+    ld b, a               ; 0x01-0x7f: Literale
+2$:
+    ld a, (hl+)
+    ld (de), a
+    inc de
+    dec b
+    jr nz, 2$
+    jr 1$
+3$:
+    bit 6, a
+    jr nz, 5$
+    and #0x3f             ; 0x80-0xbf: Wiederholung
+    add a, #2
+    ld b, a
+    ld a, (hl+)
+4$:
+    ld (de), a
+    inc de
+    dec b
+    jr nz, 4$
+    jr 1$
+5$:
+    and #0x3f             ; 0xc0-0xff: Kopie aus der Ausgabe
+    add a, #3
+    ld b, a
+    ld a, (hl+)           ; Abstand - 1
+    push hl
+    cpl                   ; hl = de - Abstand - 1
+    add a, e
+    ld l, a
+    ld a, d
+    adc a, #0xff
+    ld h, a
+6$:
+    ld a, (hl+)
+    ld (de), a
+    inc de
+    dec b
+    jr nz, 6$
+    pop hl
+    jr 1$
+  __endasm;
+}
+#else
+void unpack_asm(void) {
+  unsigned char c, n;
+  const unsigned char *from;
+
+  while ((c = *unpack_src++)) {
+    if (c < 0x80) {
+      for (n = c; n; n--) *unpack_dst++ = *unpack_src++;
+    } else if (c < 0xc0) {
+      for (n = (c & 0x3f) + 2, c = *unpack_src++; n; n--) *unpack_dst++ = c;
+    } else {
+      from = unpack_dst - *unpack_src++ - 1;
+      for (n = (c & 0x3f) + 3; n; n--) *unpack_dst++ = *from++;
+    }
+  }
+}
+#endif
+
+void unpack(unsigned char *dst, const unsigned char *src) {
+  unpack_dst = dst;
+  unpack_src = src;
+  unpack_asm();
+}
+
+// Tile mit Name (ASCII-Code) id an Pos x/y setzen
 void set_tile(int id, int x, int y) {
-  set_tile_on_vblank(x, y, id);
+  set_tile_on_vblank(x, y, tiles_map[(unsigned char)id]);
 }
 
-// Scrolling wird hier nicht genutzt
-int scroll_x, scroll_y;
-void set_scroll(int x, int y) {
+// Sichtbaren Ausschnitt der Tile-Map setzen: gbputc() scrollt nach der
+// letzten Zeile weiter, die m,n,k-Modi ziehen ihn mit mnk_scroll() mit
+// dem Cursor mit. Die Scroll-Register werden erst im VBlank-Interrupt
+// gesetzt, scroll_x/scroll_y (im HRAM) zaehlen in Tiles
+void set_scroll(unsigned char x, unsigned char y) {
   scroll_x = x;
   scroll_y = y;
-  wait_for_vblank();
-  set_bg_pos(x << 3, y << 3);
 }
 
-// Hintergrund loeschen
-void clear(void) {
-  int i, j;
-  for (i = 0; i < 32; i++)
-    for (j = 0; j < 32; j++)
-      set_tile(' ', i, j);
+// frame_count (im HRAM) zaehlt die VBlanks, damit die Hauptschleife
+// einmal pro Frame laufen kann. Nur 8 Bit: Der Zaehler laeuft alle
+// 256 Frames (etwa 4,3 s) ueber und taugt nur fuer Abstaende unter
+// 256 Frames, etwa zwischen zwei Durchlaeufen der Hauptschleife - dafuer
+// liest die CPU ihn am Stueck.
+unsigned char frames(void) {
+  return frame_count;
+}
+
+// Bis zum naechsten VBlank-Interrupt schlafen
+// (andere Interrupts wecken die CPU zwar auch, aendern aber den
+// Framezaehler nicht). Vergleich und halt laufen bei gesperrten
+// Interrupts: Kaeme der VBlank zwischen beiden, schliefe die CPU sonst
+// bis zum naechsten Interrupt und ein Frame ginge verloren.
+#ifndef HOST
+void wait_frame(void) __naked {
+  __asm
+    ld a, (_frame_count)
+    ld c, a
+1$:
+    di
+    ld a, (_frame_count)
+    cp c
+    jr nz, 2$             ; VBlank war schon
+    ei                    ; wirkt erst nach dem naechsten Befehl, der
+    halt                  ; Interrupt kommt also fruehestens im halt
+    nop
+    jr 1$
+2$:
+    ei
+    ret
+  __endasm;
+}
+#else
+void wait_frame(void) {
+  unsigned char c = frame_count;
+  while (frame_count == c) halt_cpu();
+}
+#endif
+
+// Joypad: Die Tasten werden einmal pro VBlank gelesen (joy_read()).
+// joy_state (im HRAM) haelt die gedrueckten Tasten, joy_pressed und
+// joy_released die seit dem letzten VBlank gedrueckten bzw.
+// losgelassenen. Jeder Frame mit neu gedrueckten Tasten legt zusaetzlich
+// ein Ereignis (joy_pressed) in die Warteschlange joy_fifo, damit kein
+// Druck verloren geht, wenn die Hauptschleife laenger braucht.
+// Die Bits (J_RIGHT bis J_START) stehen in cart.h.
+
+// 8 Eintraege, joy_head/joy_tail (im HRAM) zaehlen modulo 8
+unsigned char joy_fifo[8];
+
+// Die Buttons im GB sind nicht alle direkt abfragbar, vielmehr muss vorher
+// konfiguriert werden, welche Gruppe Buttons (direction oder action) abgefragt
+// werden soll. Achtung: Abfrage ist "active low", also ein 0-Bit="gedrueckt"
+
+// Konfiguration der Button-Matrix, Bits im Register "BUTTONS" (0xff00):
+
+//       Bit5        Bit6 (Bits 5 und 6 sind Ausgabe)
+//        |           |
+// Bit0 --O-rechts----O- A
+//        |           |
+// Bit1 --O-links-----O- B
+//        |           |
+// Bit2 --O-hoch------O- Select
+//        |           |
+// Bit3 --O-runter----O- Start
+//
+// (Bits 0-3 sind Eingabe)
+void joy_read(void) {
+  unsigned char s, a, i, old = joy_state;
+
+  // Richtungstasten (0x10 auf "0"); die Eingaenge brauchen nach dem
+  // Umschalten etwas Zeit, daher mehrfach lesen
+  *BUTTONS = ~0x10;
+  s = *BUTTONS;
+  s = ~*BUTTONS & 0x0f;
+
+  // Aktionstasten (0x20 auf "0")
+  *BUTTONS = ~0x20;
+  for (i = 0; i < 4; i++) a = *BUTTONS;
+  s |= (~a & 0x0f) << 4;
+
+  // Beide Gruppen waehlen: dann loest jede Taste den Joypad-Interrupt aus
+  *BUTTONS = 0;
+
+  joy_pressed = s & ~old;
+  joy_released = old & ~s;
+  joy_state = s;
+
+  if (joy_pressed) {
+    i = joy_head;
+    if (((i + 1) & 7) != joy_tail) {
+      joy_fifo[i] = joy_pressed;
+      joy_head = (i + 1) & 7;
+    }
+  }
+}
+
+// Naechstes Ereignis (Bitmaske der neu gedrueckten Tasten), 0 = keins
+unsigned char joy_event(void) {
+  unsigned char t = joy_tail, e;
+
+  if (t == joy_head) return 0;
+  e = joy_fifo[t];
+  joy_tail = (t + 1) & 7;
+  return e;
+}
+
+// Alle noch nicht abgeholten Ereignisse verwerfen
+void joy_flush(void) {
+  joy_tail = joy_head;
+}
+
+// Wird bei jedem VBlank aus dem Interrupt-Vektor in header.asm aufgerufen
+// (Register werden dort gesichert, die OAM-DMA ist dann schon gelaufen)
+void vblank_isr(void) {
+  frame_count++;
+  if (bg_flip_pending) {
+    set_bg_map(bg_front);
+    set_window_map(bg_front);
+    bg_flip_pending = 0;
+  }
+  blit_drain();
+  vq_drain();
+  set_bg_pos(scroll_x << 3, scroll_y << 3);
+  joy_read();
 }
 
-int char_pos_x, char_pos_y, scrolling;
+// Eine Zeile Leerzeichen (Tile-Nummern), wird in init() gefuellt
+unsigned char blank_row[32];
+
+// Ausgabeposition char_pos_x/char_pos_y liegt im HRAM
+unsigned char scrolling;
 
 // Tile an aktuelle Position (in char_pos_x/char_pos_y) ausgeben
 void gbputc(char c) {
-  int y_scroll = 0;
+  unsigned char y_scroll = 0;
   if (c == '\n') { char_pos_x=0; char_pos_y++; y_scroll = 1;}
   else {
     if (char_pos_y == 32) char_pos_y = 0;
@@ -201,18 +1036,17 @@ void gbputc(char c) {
     if (char_pos_y == 18) scrolling = 1;
   }
 
+  // Neue Zeile am Stueck loeschen statt mit 32 einzelnen Tiles
   if (scrolling && y_scroll) {
-    int i;
     set_scroll(0, (scroll_y + 1)&0x1f);
-    for (i = 0; i < 32; i++)
-      set_tile(' ', i, char_pos_y);
+    vram_copy(bg_draw[char_pos_y], blank_row, 32);
   }
 }
 
 // Zeichen (Tile mit Nummer c) an Pos. x/y ausgeben
-void gbputcxy(int x, int y, char c) {
-  int tmpx = char_pos_x;
-  int tmpy = char_pos_y;
+void gbputcxy(unsigned char x, unsigned char y, char c) {
+  unsigned char tmpx = char_pos_x;
+  unsigned char tmpy = char_pos_y;
 
   char_pos_x = x;
   char_pos_y = y;
@@ -227,117 +1061,655 @@ void gbputs(const char *s) {
   while (*s) gbputc(*(s++));
 }
 
+#ifdef PROFILE
+// Profiler (nur in cart_prof.gb, "make profile"): misst, wie lange
+// einzelne Abschnitte der Hauptschleife dauern. Am Anfang und Ende
+// eines Abschnitts werden DIV und LY gelesen; die Dauer wird in
+// DIV-Schritten zu 256 Takten gezaehlt (ein Frame hat 70224 Takte,
+// also etwa 274 Schritte). Das LY am Ende zeigt, in welcher Zeile
+// der Abschnitt spaetestens fertig war (ab 144: im VBlank).
+//
+// Abschnitte: A = Buttons abfragen, B = Gewinn pruefen,
+// C = Tile-Ausgabe. Die Ergebnisse liegen im WRAM (prof). B blendet
+// sie Abschnitt fuer Abschnitt als unterste Bildschirmzeile ein
+// (A, B, C, aus): Buchstabe, Minimum, Mittelwert und Maximum
+// (zweistellig, ab 99 abgeschnitten) und das spaeteste LY.
+enum PROF_SECTION { PROF_INPUT, PROF_WIN, PROF_OUTPUT, PROF_SECTIONS };
+
+struct prof {
+  unsigned char start_div, start_ly;
+  unsigned char min, max, avg, ly_max;
+  unsigned char n;
+  unsigned int sum;
+} prof[PROF_SECTIONS];
+
+unsigned char prof_overlay;
+
+void prof_reset(void) {
+  unsigned char s;
+  for (s = 0; s < PROF_SECTIONS; s++) {
+    prof[s].min = 0xff;
+    prof[s].max = prof[s].avg = prof[s].ly_max = 0;
+    prof[s].n = 0;
+    prof[s].sum = 0;
+  }
+  prof_overlay = 0;
+}
+
+void prof_begin(unsigned char s) {
+  prof[s].start_ly = *LY;
+  prof[s].start_div = *DIV;
+}
+
+// Mittelwert ueber je 64 Messungen
+void prof_end(unsigned char s) {
+  struct prof *p = &prof[s];
+  unsigned char t = *DIV - p->start_div, ly = *LY;
+
+  if (t < p->min) p->min = t;
+  if (t > p->max) p->max = t;
+  if (ly > p->ly_max) p->ly_max = ly;
+  p->sum += t;
+  if (++p->n == 64) {
+    p->avg = p->sum >> 6;
+    p->sum = 0;
+    p->n = 0;
+  }
+}
+
+#define PROF_BEGIN(s) prof_begin(s)
+#define PROF_END(s) prof_end(s)
+
+// Die Zeile wird als Tile-Nummern vorbereitet und mit einem
+// vram_copy() geschrieben - nicht ueber gbputc(), das Spalte 19 als
+// Zeilenumbruch behandeln und den Hintergrund scrollen wuerde
+unsigned char prof_row[20];
+
+void prof_put2(unsigned char x, unsigned char v) {
+  if (v > 99) v = 99;
+  prof_row[x] = tiles_map['0' + div8(v, 10)];
+  prof_row[x + 1] = tiles_map['0' + mod8(v, 10)];
+}
+
+// Unterste Bildschirmzeile (Map-Zeile scroll_y + 17 der angezeigten
+// Map): "A nn aa mm lll" fuer Abschnitt prof_overlay - 1, leer, wenn
+// ausgeblendet. Nur fuer 3x3, dort ist scroll_x immer 0; in den
+// m,n,k-Modi liegt das Window ueber Bildschirmzeile 17 und die Map-Zeile
+// darunter gehoert zum Spielfeld, dort bleibt die Zeile aus.
+void prof_show(void) {
+  struct prof *p;
+
+  mem_fill(prof_row, tiles_map[' '], sizeof(prof_row));
+  if (prof_overlay) {
+    p = &prof[prof_overlay - 1];
+    prof_row[0] = tiles_map['A' + prof_overlay - 1];
+    prof_put2(2, p->min == 0xff ? 0 : p->min);
+    prof_put2(5, p->avg);
+    prof_put2(8, p->max);
+    prof_row[11] = tiles_map['0' + div8(p->ly_max, 100)];
+    prof_put2(12, mod8(p->ly_max, 100));
+  }
+  vram_copy(bg_draw[(scroll_y + 17) & 31], prof_row, sizeof(prof_row));
+}
+#else
+#define PROF_BEGIN(s)
+#define PROF_END(s)
+#endif
+
+// Kooperative Aufgaben: Arbeit, die laenger als ein Frame dauern kann
+// (etwa der Aufbau eines neuen Spielfelds), laeuft in Scheiben ueber
+// mehrere Frames verteilt, waehrend die Hauptschleife weiter jeden Frame
+// die Eingabe bearbeitet. Eine Aufgabe ist eine Funktion nach Art der
+// Protothreads: PT_BEGIN/PT_END machen aus dem Rumpf ein switch,
+// PT_WAIT_UNTIL und PT_PAUSE merken sich ihre Zeilennummer in lc und
+// kehren zurueck, der naechste Aufruf springt per case wieder dorthin.
+// Lokale Variablen ueberleben das nicht: Was ueber eine Pause hinweg
+// gebraucht wird, gehoert nach i oder in globale Variablen. Ein eigenes
+// switch im Rumpf ist nicht erlaubt.
+enum PT_STATUS { PT_WAITING, PT_YIELDED, PT_ENDED };
+
+typedef struct task {
+  unsigned char (*run)(struct task *t);
+  unsigned int lc;       // Fortsetzungspunkt (__LINE__), 0 = Anfang
+  unsigned char lines;   // Budget pro Frame in Bildzeilen
+  unsigned char i;       // Zaehler, der Pausen ueberlebt
+} task_t;
+
+#define PT_BEGIN(t) switch ((t)->lc) { case 0:
+#define PT_END(t) } (t)->lc = 0; return PT_ENDED
+
+// Das Weiterlaufen in das case ist gewollt (gcc -Wimplicit-fallthrough)
+#ifdef __GNUC__
+#define PT_FALLTHROUGH __attribute__((fallthrough))
+#else
+#define PT_FALLTHROUGH
+#endif
+
+// Warten, bis cond gilt; bis dahin kommen die anderen Aufgaben dran
+#define PT_WAIT_UNTIL(t, cond) \
+  do { (t)->lc = __LINE__; PT_FALLTHROUGH; case __LINE__: \
+       if (!(cond)) return PT_WAITING; } while (0)
+
+// Abgeben, falls das Budget fuer diesen Frame verbraucht ist
+#define PT_PAUSE(t) \
+  do { (t)->lc = __LINE__; PT_FALLTHROUGH; case __LINE__: \
+       if (!sched_time_left()) return PT_YIELDED; } while (0)
+
+// Das Budget wird an LY gemessen, in Bildzeilen zu 456 Takten ab dem
+// Beginn des VBlanks (LY 144 = Zeile 0), wo wait_frame() zurueckkehrt.
+// Nach Zeile SCHED_END (LY 134) laeuft keine Aufgabe mehr: Der Rest
+// reicht fuer die laengste Scheibe (eine Zeile vram_copy() mit 31 Byte,
+// 8 Bloecke, also etwa 8 Bildzeilen), ohne den naechsten VBlank zu
+// verpassen.
+#define SCHED_TASKS 4
+#define SCHED_END 144
+
+task_t *sched_tasks[SCHED_TASKS];
+unsigned char sched_count;
+unsigned char sched_frame, sched_until;
+
+unsigned char frame_line(void) {
+  unsigned char ly = *LY;
+  return ly >= 144 ? ly - 144 : ly + 10;
+}
+
+// Noch Zeit fuer die laufende Aufgabe? Ist schon der naechste Frame
+// angebrochen, auf keinen Fall mehr.
+unsigned char sched_time_left(void) {
+  return frame_count == sched_frame && frame_line() < sched_until;
+}
+
+// Aufgabe (von vorne) einreihen; die Reihenfolge ist die Prioritaet
+void sched_add(task_t *t) {
+  t->lc = 0;
+  sched_tasks[sched_count++] = t;
+}
+
+unsigned char task_running(task_t *t) {
+  unsigned char i;
+
+  for (i = 0; i < sched_count; i++)
+    if (sched_tasks[i] == t) return 1;
+  return 0;
+}
+
+// Einmal pro Frame nach der Hauptschleife: jede Aufgabe einmal
+// fortsetzen, mit ihrem Budget ab jetzt, hoechstens bis SCHED_END.
+// Eine wartende Aufgabe wuerde im selben Frame weiter warten (ihre
+// Bedingung aendert meist erst der VBlank-Interrupt), also gibt es
+// keinen zweiten Durchgang.
+void sched_run(void) {
+  unsigned char i = 0, j, line;
+  task_t *t;
+
+  sched_frame = frame_count;
+  while (i < sched_count) {
+    line = frame_line();
+    if (frame_count != sched_frame || line >= SCHED_END) return;
+
+    t = sched_tasks[i];
+    sched_until = t->lines < SCHED_END - line ? line + t->lines : SCHED_END;
+    if (t->run(t) == PT_ENDED) {
+      sched_count--;
+      for (j = i; j < sched_count; j++) sched_tasks[j] = sched_tasks[j + 1];
+    } else {
+      i++;
+    }
+  }
+}
+
+// Aufgabe sofort ganz ausfuehren, ohne Budget - nur bei abgeschaltetem
+// LCD, wo keine Ausgabe auf den VBlank warten muss (init())
+void task_finish(task_t *t) {
+  t->lc = 0;
+  sched_frame = frame_count;
+  sched_until = 255;
+  while (t->run(t) != PT_ENDED);
+}
+
+// Spielmodi (mit B nach Spielende umschalten): Modus 0 ist das
+// klassische 3x3 mit dem Spielfeld aus tiles.til und der Zugtabelle.
+// Die anderen sind allgemeine m,n,k-Spiele: m x n Felder, es gewinnt,
+// wer zuerst k Steine in einer Reihe hat (waagrecht, senkrecht oder
+// diagonal); gespielt wird zu zweit.
+typedef struct {
+  unsigned char m, n, k;
+} game_mode_t;
+
+#define MNK_MAX 15
+#define GAME_MODES 3
+
+const game_mode_t game_modes[GAME_MODES] = {
+  { 3, 3, 3 },
+  { 15, 15, 5 },  // Gomoku
+  { 7, 6, 4 }
+};
+
+unsigned char game_mode, board_m, board_n, board_k, board_cells;
+
+void set_game_mode(unsigned char mode) {
+  game_mode = mode;
+  board_m = game_modes[mode].m;
+  board_n = game_modes[mode].n;
+  board_k = game_modes[mode].k;
+  board_cells = mul8(board_m, board_n);
+}
+
+// Auf der Tile-Map liegt m,n,k-Feld (x,y) in Spalte 2x+1, Zeile 2y+2,
+// dazwischen die Gitterlinien, Zeile 0 bleibt fuer die Statuszeile.
+// 15 Felder brauchen so 31 Tiles, mehr als auf den Bildschirm passen:
+// mnk_scroll() zieht den Ausschnitt mit dem Cursor mit. Die Statuszeile
+// zeigt das Window in der untersten Bildschirmzeile (Map-Zeile 0), der
+// Hintergrund ist dafuer mindestens eine Zeile weit gescrollt.
+#define MNK_TX(x) (((x) << 1) + 1)
+#define MNK_TY(y) (((y) << 1) + 2)
+
+// Gitter fuer m x n Felder: abwechselnd Zeilen "+-+-...-+" und
+// "| | ... |", die Aufgabe draw_run() kopiert sie mit je einem
+// vram_copy() in bg_draw
+unsigned char grid_line[32], grid_cells[32];
+
+void grid_prepare(void) {
+  unsigned char i, w = MNK_TX(board_m);
+
+  for (i = 0; i < w; i++) {
+    grid_line[i] = tiles_map[(i & 1) ? '-' : '+'];
+    grid_cells[i] = tiles_map[(i & 1) ? ' ' : '|'];
+  }
+}
+
+// Ausschnitt so legen, dass Tile-Spalte/Zeile des Felds (x,y) mit
+// 2 Tiles Rand sichtbar ist (20 x 17 Tiles, die unterste Zeile gehoert
+// dem Window), ohne ueber das Spielfeld hinaus zu scrollen
+void mnk_scroll(unsigned char x, unsigned char y) {
+  unsigned char tx = MNK_TX(x), ty = MNK_TY(y);
+  unsigned char sx = scroll_x, sy = scroll_y;
+  unsigned char w = MNK_TX(board_m), h = MNK_TY(board_n);
+
+  if (tx < sx + 2) sx = tx < 2 ? 0 : tx - 2;
+  if (tx > sx + 17) sx = tx - 17;
+  if (sx + 20 > w) sx = w > 20 ? w - 20 : 0;
+
+  if (ty < sy + 2) sy = ty - 2;
+  if (ty > sy + 14) sy = ty - 14;
+  if (sy + 17 > h) sy = h > 17 ? h - 17 : 0;
+  if (sy < 1) sy = 1;
+
+  set_scroll(sx, sy);
+}
+
+// Welche Map welchen Modus zeigt: nach einem Wechsel muss die Map
+// einmal ganz geloescht werden
+unsigned char map_mode[2];
+
+// 1-Spieler-Modus: Spieler 2 ("O") ist der Computer
+// Umschalten jederzeit mit SELECT, Anzeige rechts oben
+unsigned char one_player;
+
+void toggle_one_player(void) {
+  one_player = !one_player;
+  gbputcxy(18, 0, one_player && !game_mode ? '1' : '2');
+}
+
+// Keine Ausgabe mehr unterwegs: vram_copy() muss dann nicht mit
+// halt_cpu() warten, blit_map() und bg_flip() duerfen loslegen
+#define VRAM_IDLE() (vq_head == vq_tail && !blit_rows)
+
+// Bildschirm fuer ein neues Spiel als Aufgabe: Statuszeile und
+// Spielfeld Zeile fuer Zeile in der unsichtbaren Map aufbauen, dann
+// umschalten. Bei eingeschaltetem LCD verteilt sich das ueber einige
+// Frames (15x15 nach einem Moduswechsel: 32 Zeilen loeschen, 31 Zeilen
+// Gitter), die Hauptschleife bedient solange weiter die Tasten.
+// init() fuehrt sie bei abgeschaltetem LCD mit task_finish() am Stueck
+// aus, dann geht alles direkt ins VRAM.
+#define DRAW_LINES 128
+task_t draw_task;
+
+unsigned char draw_run(task_t *t) {
+  PT_BEGIN(t);
+
+  // Den Bildschirm fuer das neue Spiel in der unsichtbaren Map
+  // aufbauen, das Ergebnis des letzten Spiels bleibt bis zum
+  // Umschalten stehen. Dort steht noch der Bildschirm vom vorletzten
+  // Spiel, die Statuszeile muss also auch geloescht werden, nach
+  // einem Moduswechsel die ganze Map.
+  bg_compose();
+  if (map_mode[bg_front ^ 1] != game_mode) {
+    for (t->i = 0; t->i < 32; t->i++) {
+      PT_WAIT_UNTIL(t, VRAM_IDLE());
+      vram_copy(bg_draw[t->i], blank_row, 32);
+      PT_PAUSE(t);
+    }
+    map_mode[bg_front ^ 1] = game_mode;
+  }
+  gbputcxy(0, 0, ' ');
+  gbputcxy(1, 0, ' ');
+  gbputcxy(10, 0, ' ');
+
+  // Ausgabe ab Zeichenposition Spalte 0, Zeile 3
+  // Eine Zeichenposition ist 8x8 Pixel gross
+
+  // Hier wird ein geschicktes Mapping verwendet:
+  // Die Tiles sind nach dem ASCII-Code des jeweiligen Zeichens
+  // benannt. set_tile() schlaegt zum ASCII-Code der ausgegebenen
+  // Zeichen die Tile-Nummer in tiles_map nach und schreibt sie in die
+  // Hintergrundbildschirm Tilemap.
+  // Entsprechend wird an der jeweiligen Stelle die Tile
+  // mit dem Namen des Zeichens dargestellt.
+  // Die Tiles sind in der Datei "tiles.til" definiert,
+  // diese wird beim Bauen (mit make) automatisch in die
+  // notwendigen Hexdaten fuer den Assembler uebersetzt.
+
+  // Leerzeichen " " ist Tile 0x20, das keine Pixel gesetzt hat
+  // Die Tiles "|" (0x7c), "-" (0x2d) und "+" (0x2b) sind so
+  // gestaltet, dass die Darstellung auf dem Bildschirm dem
+  // Aussehen des jeweiligen Zeichens entspricht.
+
+  // Das Spielfeld selbst ist in tiles.til als Bildschirmvorlage
+  // "board" aus genau diesen Zeichen definiert. convtiles hat die
+  // Zeichen dort schon in Tile-Nummern umgesetzt, blit_map() kopiert
+  // die Vorlage daher zeilenweise ohne Umweg ueber gbputc().
+  // Die m,n,k-Spielfelder sind nur ein Gitter aus denselben Tiles.
+  if (game_mode) {
+    grid_prepare();
+    for (t->i = 0; t->i <= board_n << 1; t->i++) {
+      PT_WAIT_UNTIL(t, VRAM_IDLE());
+      vram_copy(bg_draw[1 + t->i], (t->i & 1) ? grid_cells : grid_line,
+                MNK_TX(board_m));
+      PT_PAUSE(t);
+    }
+  } else {
+    PT_WAIT_UNTIL(t, VRAM_IDLE());
+    blit_map(tiles_board, 0, 3);
+  }
+
+  // Anzahl der menschlichen Spieler anzeigen - erst jetzt, SELECT
+  // kann waehrend des Aufbaus gedrueckt worden sein
+  gbputcxy(18, 0, one_player && !game_mode ? '1' : '2');
+
+  // Fertig: Ausschnitt fuer das neue Spiel (Cursor in der Mitte) setzen
+  // und im naechsten VBlank auf einen Schlag umschalten. Beides bei
+  // gesperrten Interrupts, sonst koennte ein VBlank dazwischen das alte
+  // Bild mit dem neuen Ausschnitt zeigen.
+  PT_WAIT_UNTIL(t, VRAM_IDLE());
+  irq_off();
+  if (game_mode) mnk_scroll(board_m >> 1, board_n >> 1);
+  else set_scroll(0, 0);
+  bg_flip();
+  irq_on();
+  PT_WAIT_UNTIL(t, !bg_flip_pending);
+
+  PT_END(t);
+}
+
+// Gesetzt, wenn init() den Bildschirm fuer das erste Spiel schon
+// aufgebaut hat
+unsigned char screen_ready;
+
 void main(void);
 
 // Grundlegende Initialisierung des Gameboy
 void init(void) {
-  int i, j;
-
-  // LCD deaktivieren (dann Zugriff auf Sprites ohne Warten auf VBlank moeglich)
+  // Das LCD darf nur im VBlank abgeschaltet werden. Danach ist das
+  // VRAM frei: Tiles, beide Maps, OAM und der Bildschirm fuer das erste
+  // Spiel werden am Stueck geschrieben, eingeschaltet wird erst, wenn
+  // alles fertig ist ("make bench" misst die Zeit bis zum ersten Frame,
+  // Region 0x0100:_wait_frame).
+  *IRQEN = 0;
+  if (*LCDCONT & LCD_ENABLE) wait_for_vblank();
   *LCDCONT = 0;
-  disable_lcd();
-
-  // Wir nutzen kein Window
-  disable_window();
 
   // Der Hintergrund ist ab Position (0,0) gemappt
   set_bg_pos(0, 0);
 
-  // Interrupts abschalten
-  *IRQEN = 0;
+  // Das RAM ist beim Einschalten nicht geloescht:
+  // Tile-Warteschlange leeren, Scroll-Position zuruecksetzen
+  vq_head = vq_tail = 0;
+  blit_rows = 0;
+  frame_count = 0;
+  scroll_x = scroll_y = 0;
+  char_pos_x = char_pos_y = scrolling = 0;
+  joy_state = joy_head = joy_tail = 0;
+  sched_count = 0;
+  one_player = 0;
+#ifdef PROFILE
+  prof_reset();
+#endif
 
   // Alle Sprites auf Position (0,0) setzen -> links oben ausserhalb des Bildschirms
-  for (i = 0; i < 40; i++)
-    (SPRITES + i)->x = (SPRITES + i)->y = 0;
-  
+  // (im Schatten-OAM, dann per DMA ins OAM kopieren)
+  mem_fill((unsigned char *)shadow_oam, 0, sizeof(sprite_t) * 40);
+  init_oam_dma();
+  oam_dma();
+
   // Tile-Daten aus "tiles"-Array (aus tiles.til generiert) in Tile-Speicher kopieren
-  for (i = 0; i < 256; i++)
-    for (j = 0; j < 16; j++)
-      LO_TILES[i][j] = tiles[i][j];
+  // (nur die tiles_count tatsaechlich benutzten Tiles)
+#ifdef TILES_PACKED
+  unpack(LO_TILES[0], tiles_packed);
+#else
+  mem_copy(LO_TILES[0], tiles[0], tiles_count * 16);
+#endif
+
+  // Beide Background-Maps loeschen: LO_MAP und HI_MAP liegen direkt
+  // hintereinander (0x9800-0x9fff), also ein einziger Durchgang
+  mem_fill(LO_MAP[0], tiles_map[' '], 2 * 32 * 32);
+  mem_fill(blank_row, tiles_map[' '], 32);
 
   // Background-Map und Tile-Map 0 nutzen
+  bg_front = bg_flip_pending = 0;
+  bg_draw = LO_MAP;
   set_bg_map(0);
   set_tiles(0);
 
+  // Bildschirm fuer das erste Spiel (3x3, 2 Spieler), main() uebernimmt
+  // ihn; das Window (Statuszeile der m,n,k-Modi) liegt in der
+  // untersten Bildschirmzeile
+  set_game_mode(0);
+  map_mode[0] = map_mode[1] = 0;
+  set_window_pos(7, 136);
+  draw_task.run = draw_run;
+  draw_task.lines = DRAW_LINES;
+  task_finish(&draw_task);
+  screen_ready = 1;
+
   // Normale Background-Palette
   set_bgpal(PAL_NORMAL);
 
-  // Background aktivieren, dann LCD anschalten
+  // Background aktivieren, dann LCD anschalten (Window bleibt aus)
   enable_bg();
   enable_lcd();
 
+  // VBlank-Interrupt (arbeitet die Tile-Warteschlange ab) und
+  // Joypad-Interrupt (weckt die CPU aus halt_cpu()) aktivieren
+  *IRQFLAGS = 0;
+  *IRQEN = IRQ_VBLANK | IRQ_JOYPAD;
+
   // ...los geht's!
   main();
 
   for (;;);
 }
  
-// Das Spielfeld fuer tic-tac-toe ist einfach eine
-// 3x3-Matrix mit Inhalt:
-// "0" (kein Stein), 
-// "1" (Stein von Spieler 1, "X"),
-// "2" (Stein von Spieler 2, "O")
-int field[3][3];
-int xp, yp;
+// Das Spielfeld fuer tic-tac-toe besteht aus zwei Bitmasken mit je
+// 9 Bit, eine pro Spieler:
+// stones[0] (Steine von Spieler 1, "X"),
+// stones[1] (Steine von Spieler 2, "O")
+// Feld (x,y) entspricht Bit y*3+x, ein Feld ist frei, wenn das
+// Bit in keiner der beiden Masken gesetzt ist.
+unsigned int stones[2];
+unsigned char xp, yp;
+
+// Dieselbe Stellung als Zahl zur Basis 3 (Ziffer y*3+x: 0 = frei,
+// 1 = "X", 2 = "O"), Index in die Zugtabelle ai_moves
+unsigned int pos_index;
+
+// Bit fuer Feld (x,y), indiziert als cell_bits[x][y]
+const unsigned int cell_bits[3][3] = {
+  { 0x001, 0x008, 0x040 },
+  { 0x002, 0x010, 0x080 },
+  { 0x004, 0x020, 0x100 }
+};
+
+// Die 8 Gewinnreihen: 3 Zeilen, 3 Spalten, 2 Diagonalen
+const unsigned int win_masks[8] = {
+  0x007, 0x038, 0x1c0,
+  0x049, 0x092, 0x124,
+  0x111, 0x054
+};
+
+// Wert der Ziffer fuer Feld (x,y) im Index zur Basis 3, cell_pow3[x][y]
+const unsigned int cell_pow3[3][3] = {
+  { 1,  27,  729 },
+  { 3,  81, 2187 },
+  { 9, 243, 6561 }
+};
+
+// Feld y*3+x zurueck in Koordinaten x und y
+const unsigned char cell_x[9] = { 0, 1, 2, 0, 1, 2, 0, 1, 2 };
+const unsigned char cell_y[9] = { 0, 0, 0, 1, 1, 1, 2, 2, 2 };
+
+// Alle 9 Felder belegt
+#define FULL_MASK 0x1ff
+
+// Ergebnis des letzten Zugs, wird nur in set_stone() neu berechnet
+unsigned char winner, board_full;
+
+// Spielfeld leeren
+void clear_field(void) {
+  stones[0] = stones[1] = 0;
+  pos_index = 0;
+  winner = board_full = 0;
+}
+
+// Ist Feld (x,y) noch unbesetzt?
+int field_free(int x, int y) {
+  return ((stones[0] | stones[1]) & cell_bits[x][y]) == 0;
+}
+
+// Stein von Spieler 1 oder 2 auf Feld (x,y) setzen und pruefen,
+// ob der Spieler damit gewonnen hat bzw. das Spielfeld voll ist.
+// Nur der Spieler, der gerade gezogen hat, kann dadurch gewinnen.
+void set_stone(int player, int x, int y) {
+  unsigned int m;
+  unsigned char i;
+
+  m = stones[player - 1] |= cell_bits[x][y];
+  pos_index += cell_pow3[x][y];
+  if (player == 2) pos_index += cell_pow3[x][y];
+
+  for (i = 0; i < 8; i++) {
+    if ((m & win_masks[i]) == win_masks[i]) {
+      winner = player;
+      break;
+    }
+  }
+
+  board_full = (stones[0] | stones[1]) == FULL_MASK;
+}
+
+// Aus genai.c generierte Tabelle mit dem besten Zug fuer jede
+// Stellung (in ai.inc) importieren: zwei Zuege pro Byte, gerader
+// Index im unteren Nibble
+#include "ai.inc"
+
+// Besten Zug fuer den Spieler am Zug nachschlagen - kein Suchen
+// zur Laufzeit, nur ein Tabellenzugriff
+// Rueckgabe: Feld y*3+x
+unsigned char ai_move(void) {
+  unsigned char b = ai_moves[pos_index >> 1];
+  if (pos_index & 1) return b >> 4;
+  return b & 0xf;
+}
 
 // Feststellen, ob einer der Spieler gewonnen hat
 // Rueckgabe: 0 (kein Gewinner), 1 oder 2 (Spieler 1 oder 2 gewonnen)
 int check_win(void) {
-  int w = 0;
-  int i;
-  // Pruefen, ob Zeile mit drei identischen Steinen ("X" oder "O") existiert
-  for (i=0; i<3; i++) {
-    if ((field[0][i] == field[1][i]) && (field[1][i] == field[2][i])) {
-      w = field[0][i];
-      // Wenn w = 0, dann haben wir eine leere Zeile -> kein Gewinner
-      if (w>0) return w;
-    }
-  }
+  return winner;
+}
 
-  // Pruefen, ob Spalte mit drei identischen Steinen ("X" oder "O") existiert
-  for (i=0; i<3; i++) {
-    if ((field[i][0] == field[i][1]) && (field[i][1] == field[i][2])) {
-      w = field[i][0];
-      // Wenn w = 0, dann haben wir eine leere Zeile -> kein Gewinner
-      if (w>0) return w;
-    }
-  }
+// Feststellen, ob Spielfeld voll ist, also auf allen Feldern
+// (x=0..2, y=0..2) ein Stein von Spieler 1 oder 2 gesetzt ist
+int full(void) {
+  return board_full;
+}
+
+// Spielfeld der m,n,k-Modi: ein Byte pro Feld (0 = frei, 1 oder 2 =
+// Stein des Spielers), Zeilen zu 16 Byte, damit fuer den Index nur
+// geschoben statt multipliziert werden muss
+unsigned char mnk_board[MNK_MAX][16];
+unsigned char mnk_stones;
 
-  // Diagonalen ((0,0),(1,1),(2,2)) und ((2,0),(1,1),(0,2)) pruefen
-  if ((field[0][0] == field[1][1]) && (field[1][1] == field[2][2])) {
-    w = field[0][0];
-    if (w>0) return w;
+void mnk_clear_field(void) {
+  mem_fill(mnk_board[0], 0, sizeof(mnk_board));
+  mnk_stones = 0;
+  winner = board_full = 0;
+}
+
+int mnk_free(unsigned char x, unsigned char y) {
+  return mnk_board[y][x] == 0;
+}
+
+// Steine von Spieler p ab Feld (x,y) in Richtung (dx,dy), ohne (x,y)
+// selbst. Ein Schritt ueber den linken oder oberen Rand laeuft als
+// unsigned char auf 255 ueber und ist damit ebenfalls ausserhalb.
+// Mehr als k-1 muessen nicht gezaehlt werden.
+unsigned char mnk_run(unsigned char p, unsigned char x, unsigned char y,
+                      signed char dx, signed char dy) {
+  unsigned char n = 0;
+
+  while (n < board_k - 1) {
+    x += dx;
+    y += dy;
+    if (x >= board_m || y >= board_n || mnk_board[y][x] != p) break;
+    n++;
   }
-  if ((field[0][2] == field[1][1]) && (field[1][1] == field[2][0])) {
-    w = field[0][2];
-    if (w>0) return w;
+
+  return n;
+}
+
+// Die 4 Linien durch ein Feld: waagrecht, senkrecht, beide Diagonalen
+const signed char mnk_dx[4] = { 1, 0, 1, 1 };
+const signed char mnk_dy[4] = { 0, 1, 1, -1 };
+
+// Stein setzen wie set_stone(), aber gewinnen kann nur eine Reihe
+// durch das neue Feld: statt des ganzen Spielfelds (225 Felder bei
+// 15x15) werden hoechstens 8*(k-1) Nachbarfelder gelesen
+void mnk_set_stone(unsigned char player, unsigned char x, unsigned char y) {
+  unsigned char i;
+
+  mnk_board[y][x] = player;
+  mnk_stones++;
+
+  for (i = 0; i < 4; i++) {
+    if (mnk_run(player, x, y, mnk_dx[i], mnk_dy[i]) +
+        mnk_run(player, x, y, -mnk_dx[i], -mnk_dy[i]) + 1 >= board_k) {
+      winner = player;
+      break;
+    }
   }
 
-  return w;
+  board_full = mnk_stones == board_cells;
 }
 
-// Feststellen, ob Spielfeld voll ist
-// Ueberprueft, ob alle Felder (x=0..2, y=0..2) einen Wert != 0 haben,
-// also ein Stein von Spieler 1 oder 2 gesetzt ist
-int full(void) {
-  int i,j;
-  int f = 1;
-  for (i=0; i<3; i++) {
-    for (j=0; j<3; j++) {
-      if (field[i][j] == 0) f = 0;
-    } 
-  } 
-  return f;
+// Cursor (Sprite #0) auf m,n,k-Feld (x,y) setzen, Ausschnitt mitziehen
+void mnk_cursor(unsigned char x, unsigned char y) {
+  mnk_scroll(x, y);
+  shadow_oam[0].x = ((MNK_TX(x) - scroll_x) << 3) + 8;
+  shadow_oam[0].y = ((MNK_TY(y) - scroll_y) << 3) + 16;
 }
 
 // Funktionen, um "X", "O" oder " " an Zeichenposition (x,y)
 // auf dem Bildschirm zu setzen
 void setx(int x, int y) {
+  PROF_BEGIN(PROF_OUTPUT);
   gbputcxy(6 + x * 4, 4 + y * 4, 'X');
+  PROF_END(PROF_OUTPUT);
 }
 
 void seto(int x, int y) {
+  PROF_BEGIN(PROF_OUTPUT);
   gbputcxy(6 + x * 4, 4 + y * 4, 'O');
+  PROF_END(PROF_OUTPUT);
 }
 
 void clearxy(int x, int y) {
@@ -345,157 +1717,206 @@ void clearxy(int x, int y) {
 }
 
 void main(void) {
-  clear();
   set_scroll(0, 0);
-  int x = 0, y = 0;
-  int end;
+  unsigned char x = 0, y = 0;
+  unsigned char end;
+
+  unsigned char ev, a_pressed;
+
+  // Fuer feste Zeitschritte: Frame des letzten Durchlaufs und Anzahl
+  // der seitdem vergangenen Frames
+  unsigned char now, last_frame = frames();
+  unsigned char steps, dir;
+
+  // m,n,k-Modi: Cursor auf Feld (cx,cy), rep zaehlt die Frames bis zur
+  // naechsten Bewegung bei gehaltener Richtungstaste
+  unsigned char cx = 0, cy = 0, rep = 0;
 
   // Das Spiel endet nie...
   while (1) {
     end = 0;
     char_pos_x = char_pos_y = scrolling = 0;
   
-    int player = 1;
-    int i, j;
+    unsigned char player = 1;
 
     // Interne Darstellung des Spielfelds initialisieren
-    // (3x3)-Matrix: 0 = unbelegt, 1 = Spieler 1 "X", 2 = Spieler 2 "O"
-    for (i=0; i<3; i++) {
-      for (j=0; j<3; j++) {
-        field[i][j] = 0;
+    // (beide Bitmasken leer bzw. m,n,k-Spielfeld leer: alle Felder unbelegt)
+    if (game_mode) mnk_clear_field();
+    else clear_field();
+
+    // Den Bildschirm fuer das neue Spiel aufbauen - beim ersten Spiel
+    // hat das schon init() erledigt, solange das LCD aus war. Sonst
+    // laeuft die Aufgabe draw_task im Rest jedes Frames, bis das neue
+    // Bild steht; die Schleife hier bedient solange SELECT.
+    // Den Computergegner gibt es nur fuer 3x3.
+    if (screen_ready) screen_ready = 0;
+    else {
+      sched_add(&draw_task);
+      for (;;) {
+        sched_run();
+        if (!task_running(&draw_task)) break;
+        wait_frame();
+        while ((ev = joy_event()))
+          if (ev & J_SELECT) toggle_one_player();
       }
+      last_frame = frames();
     }
-  
-    // Ausgabe ab Zeichenposition Spalte 0, Zeile 3
-    // Eine Zeichenposition ist 8x8 Pixel gross
-    char_pos_x = 0; char_pos_y = 3;
-
-    // Hier wird ein geschicktes Mapping verwendet:
-    // Der ASCII-Code der ausgegebenen Zeichen wird in die 
-    // Hintergrundbildschirm Tilemap geschrieben.
-    // Entsprechend wird an der jeweiligen Stelle die Tile
-    // mit dem ASCII-Code dargestellt.
-    // Die Tiles sind in der Datei "tiles.til" definiert,
-    // diese wird beim Bauen (mit make) automatisch in die
-    // notwendigen Hexdaten fuer den C-Compiler uebersetzt.
-
-    // Leerzeichen " " ist Tile 0x20, das keine Pixel gesetzt hat
-    // Die Tiles "|" (0x7c), "-" (0x2d) und "+" (0x2b) sind so
-    // gestaltet, dass die Darstellung auf dem Bildschirm dem
-    // Aussehen des jeweiligen Zeichens entspricht.
-
-    // Mit "\n" wird die Ausgabeposition auf Spalte 0, naechste Zeile
-    // gesetzt.
-
-    gbputs("        |   |   \n");
-    gbputs("        |   |   \n");
-    gbputs("        |   |   \n");
-    gbputs("     ---+---+---\n");
-    gbputs("        |   |   \n");
-    gbputs("        |   |   \n");
-    gbputs("        |   |   \n");
-    gbputs("     ---+---+---\n");
-    gbputs("        |   |   \n");
-    gbputs("        |   |   \n");
-    gbputs("        |   |   \n");
+
+#ifdef PROFILE
+    // Das neue Bild hat die Profiler-Zeile ueberschrieben
+    if (game_mode) prof_overlay = 0;
+    else if (prof_overlay) prof_show();
+#endif
   
     // Der Sprite-Speicher ist von der CPU aus nur zuverlaessig in der
     // vertikalen Austastluecke des Videosignals (VBlank) beschreibbar.
     // In der restlichen Zeit hat der LCD-Controller Zugriff auf den
     // Sprite-Speicher, um die jeweiligen Displaydaten darzustellen.
 
-    // Daher warten wir hier erst darauf, dass eine Darstellung stattfindet
-    wait_for_display();
-    // ...und dann der Uebergang zu VBlank. Damit stellen wir sicher, 
-    // dass der folgende Code direkt _zu Beginn_ der VBlank-Periode
-    // ausgefuehrt wird. Damit wird sichergestellt, dass genug Zeit 
-    // fuer den Zugriff auf den Sprite-Speicher zur Verfuegung steht.
-    wait_for_vblank();
+    // Daher schreiben wir die Sprite-Daten nur in den Schatten-OAM.
+    // Der VBlank-Interrupt kopiert ihn zu Beginn jeder VBlank-Periode
+    // per DMA in den Sprite-Speicher - wir muessen hier nicht warten.
   
     // Bit 2 von LCDCONT aktiviert die Sprite-Anzeige
     *LCDCONT = *LCDCONT | 0x2;
     // Dies setzt die Farbpalette fuer die Sprites
     *SPRITEPAL0 = 0xE2; // palette
-  
-    // Initialposition fuer das Sprite
-    y = 70; x = 80;
-  
-    // Wir setzen hier fuer den Cursor (Sprite #0) die vier benoetigten Parameter:
-    (SPRITES+0)->y = y;        // y-Position (in Pixeln, 8 Pixel vert Offset)
-    (SPRITES+0)->x = x;        // x-Position (in Pixeln, 8 Pixel horiz Offset)
-    (SPRITES+0)->tile = 'Q';   // Tile des Cursor-Sprite (0x51) - Bitmap fuer den "X"-Cursor
-    (SPRITES+0)->flags = 0x00; // Parameter fuer das Sprite
+
+    // In den m,n,k-Modi zeigt das Window die Statuszeile, der Cursor
+    // beginnt in der Mitte des Spielfelds
+    if (game_mode) {
+      enable_window();
+      cx = board_m >> 1;
+      cy = board_n >> 1;
+      rep = 0;
+      mnk_cursor(cx, cy);
+    } else {
+      disable_window();
+
+      // Initialposition fuer das Sprite
+      y = 70; x = 80;
+
+      // Wir setzen hier fuer den Cursor (Sprite #0) die vier benoetigten Parameter:
+      shadow_oam[0].y = y;        // y-Position (in Pixeln, 8 Pixel vert Offset)
+      shadow_oam[0].x = x;        // x-Position (in Pixeln, 8 Pixel horiz Offset)
+    }
+    shadow_oam[0].tile = tiles_map['Q'];   // Tile des Cursor-Sprite (0x51) - Bitmap fuer den "X"-Cursor
+    shadow_oam[0].flags = 0x00; // Parameter fuer das Sprite
   
     // Schleife, bis wir feststellen, dass das Spiel beendet ist
     while (end==0) {
 
-      // Sprite-Speicher beschreiben, also warten...
-      wait_for_display();
-      wait_for_vblank();
+      // Einmal pro Frame: CPU bis zum naechsten VBlank anhalten
+      // Die Buttons werden direkt danach abgefragt, die Eingabe wirkt
+      // also genau einen Frame spaeter auf dem Bildschirm.
+      wait_frame();
+
+      // Feste Zeitschritte: normalerweise ist seit dem letzten Durchlauf
+      // genau ein Frame vergangen, mehr nur, wenn ein Durchlauf (z.B.
+      // beim Zeichnen) laenger gedauert hat. Die Cursorbewegung wird
+      // dann entsprechend oft ausgefuehrt, die Geschwindigkeit bleibt gleich.
+      now = frames();
+      steps = now - last_frame;
+      if (steps > 8) steps = 8;
+      last_frame = now;
 
       // Cursorform (Sprite #0) auf die Tile fuer den aktuellen Spieler setzen
       // Spieler 1 hat "X" (Tile 0x51 = ASCII-Code von 'Q'), 
       // Spieler 2 hat "O" (Tile 0x52 = ASCII-Code von 'R')
-      (SPRITES+0)->tile = player+'P';  // Tricky: 'P'+1 = 'Q', 'P'+2 = 'R'
+      PROF_BEGIN(PROF_OUTPUT);
+      shadow_oam[0].tile = tiles_map[player+'P'];  // Tricky: 'P'+1 = 'Q', 'P'+2 = 'R'
       gbputcxy(10, 0, 0x30+player);
+      PROF_END(PROF_OUTPUT);
   
-      // Abfrage der Buttons des GB
-      // Wir wollen hier den Cursor mit dem direction pad (hoch, runter, links, rechts)
-      // bewegen.
-
-      // Die Buttons im GB sind nicht alle direkt abfragbar, vielmehr muss vorher 
-      // konfiguriert werden, welche Gruppe Buttons (direction oder action) abgefragt
-      // werden soll. Achtung: Abfrage ist "active low", also ein 0-Bit="gedrueckt"
-
-      // Konfiguration der Button-Matrix, Bits im Register "BUTTONS" (0xff00):
-
-      //       Bit5        Bit6 (Bits 5 und 6 sind Ausgabe)
-      //        |           |
-      // Bit0 --O-rechts----O- A
-      //        |           |
-      // Bit1 --O-links-----O- B
-      //        |           |
-      // Bit2 --O-hoch------O- Select
-      //        |           |
-      // Bit3 --O-runter----O- Start
-      //
-      // (Bits 0-3 sind Eingabe)
-
-
-      // Direction buttons waehlen, indem Bit 5 auf "0" gesetzt wird
-      *BUTTONS = ~0x10; // Bit 5 auf 1 setzen und invertieren!
-
-      // jetzt die Buttons einlesen, invertieren ("~") und nur untere 4 ("& 0xf") betrachten
-      switch (~*BUTTONS & 0xf) {
-        case 1<<3: // runter ist bit 3...
-          y++; if (y>144+8) y = 0; // dann y-Pos. des Cursor-Sprites erhoehen, wrap wenn unten
-          break;
-        case 1<<2: // hoch (bit 2)
-          y--; if (y<0) y = 144+8; // y-Pos. des Cursor-Sprites erniedrigen, wrap wenn oben
-          break;
-        case 1<<1: // links (bit 1)
-          x--; if (x<0) x = 172+8; // ...entsprechend fuer die x-Position
-          break;
-        case 1<<0: // rechts (bit 0)
-          x++; if (x>172+8) x = 0;
-          break;
+      // Gehaltene Richtungstaste bewegt den Cursor (Zustand aus dem
+      // letzten VBlank, siehe joy_read())
+      PROF_BEGIN(PROF_INPUT);
+      dir = joy_state & (J_RIGHT | J_LEFT | J_UP | J_DOWN);
+
+      // m,n,k: ein Feld pro Tastendruck, gehalten nach 16 Frames
+      // alle 4 Frames ein weiteres; Diagonalen zaehlen nicht
+      if (game_mode) {
+        if (!dir || (joy_pressed & dir)) rep = 0;
+        if (rep > steps) rep -= steps;
+        else if (dir) {
+          rep = rep ? 4 : 16;
+          if (dir == J_DOWN && cy < board_n - 1) cy++;
+          if (dir == J_UP && cy > 0) cy--;
+          if (dir == J_LEFT && cx > 0) cx--;
+          if (dir == J_RIGHT && cx < board_m - 1) cx++;
+          mnk_cursor(cx, cy);
+        }
+        steps = 0;
+      }
+
+      // ein Pixel Bewegung pro vergangenem Frame
+      for (; steps; steps--) {
+        switch (dir) {
+          case 1<<3: // runter ist bit 3...
+            y++; if (y>144+8) y = 0; // dann y-Pos. des Cursor-Sprites erhoehen, wrap wenn unten
+            break;
+          case 1<<2: // hoch (bit 2)
+            if (y-- == 0) y = 144+8; // y-Pos. des Cursor-Sprites erniedrigen, wrap wenn oben
+            break;
+          case 1<<1: // links (bit 1)
+            if (x-- == 0) x = 172+8; // ...entsprechend fuer die x-Position
+            break;
+          case 1<<0: // rechts (bit 0)
+            x++; if (x>172+8) x = 0;
+            break;
+        }
       }
 
       // Position des Cursor-Sprites aktualisieren
-      wait_for_display();
-      wait_for_vblank();
-      (SPRITES+0)->y = y;
-      (SPRITES+0)->x = x;
+      if (!game_mode) {
+        shadow_oam[0].y = y;
+        shadow_oam[0].x = x;
+      }
 
-      // Action buttons selektieren (bit 6 auf "0")
-      *BUTTONS = ~0x20;
+      // Tastendruecke seit dem letzten Durchlauf aus der Warteschlange
+      // holen - jeder Druck zaehlt genau einmal, auch wenn er laenger
+      // gehalten wird oder die Schleife gerade mehrere Frames brauchte
+      a_pressed = 0;
+      while ((ev = joy_event())) {
+        // SELECT schaltet den Computergegner ein oder aus
+        if (ev & J_SELECT) toggle_one_player();
+        if (ev & J_A) a_pressed = 1;
+#ifdef PROFILE
+        // B schaltet die Profiler-Zeile weiter: A, B, C, aus (nur 3x3)
+        if ((ev & J_B) && !game_mode) {
+          prof_overlay = prof_overlay == PROF_SECTIONS ? 0 : prof_overlay + 1;
+          prof_show();
+        }
+#endif
+      }
+      PROF_END(PROF_INPUT);
 
-      // Hier fragen wir nur den "A"-Button ab, andere werden ignoriert
-      if ((~*BUTTONS & 0xf) == 0x01) {
-          xp = -1; yp = -1;
+#ifdef PROFILE
+      // Die Profiler-Zeile wird alle 32 Frames aktualisiert
+      if (prof_overlay && (now & 31) == 0) prof_show();
+#endif
 
+      // Im 1-Spieler-Modus zieht der Computer sofort aus der Zugtabelle
+      if (one_player && player == 2 && !game_mode) {
+        unsigned char m = ai_move();
+        seto(cell_x[m], cell_y[m]);
+        set_stone(2, cell_x[m], cell_y[m]);
+        player = 1;
+      }
+      // m,n,k: Stein auf das Feld unter dem Cursor, falls frei
+      else if (a_pressed && game_mode) {
+        if (mnk_free(cx, cy)) {
+          PROF_BEGIN(PROF_OUTPUT);
+          set_tile(player == 1 ? 'X' : 'O', MNK_TX(cx), MNK_TY(cy));
+          PROF_END(PROF_OUTPUT);
+          mnk_set_stone(player, cx, cy);
+          player = 3 - player;
+        }
+      }
+      else if (a_pressed) {
 #if 0
           // Diese Funktion prueft die x/y-Koordinaten explizit
+          xp = yp = 0xff;
           if ((x >  45) && (x <  72)) xp = 0;
           if ((x >  74) && (x < 103)) xp = 1;
           if ((x > 105) && (x < 132)) xp = 2;
@@ -504,22 +1925,25 @@ void main(void) {
           if ((y >  97) && (y < 123)) yp = 2;
 #endif
 
-          // Hier wird Division verwendet, um die Pixelkoordinaten des Cursor-Sprites
-          // in Feldkoordinaten (x und y von 0-2) umzurechnen
-          // Die GB-CPU kann nicht dividieren, daher Hilfsfunktion div verwenden
-          xp = _div(x-45, 28, 0);
-          yp = _div(y-37, 28, 0);
+          // Hier wird eine Tabelle verwendet, um die Pixelkoordinaten des
+          // Cursor-Sprites in Feldkoordinaten (x und y von 0-2) umzurechnen
+          // Die GB-CPU kann nicht dividieren; die Tabelle enthaelt fuer
+          // jeden Abstand zum Spielfeldrand bereits das Ergebnis von
+          // Abstand/28 (oder 0xff ausserhalb des Spielfelds)
+          xp = pixel_to_cell[(unsigned char)(x-45)];
+          yp = pixel_to_cell[(unsigned char)(y-37)];
 
           // Wenn der Cursor in einem Feld stand und Button "A" gedrueckt...
-          if ((xp >= 0) && (xp < 3) && (yp >= 0) && (yp < 3)) {
+          if ((xp < 3) && (yp < 3)) {
             // und das entsprechende Feld noch unbesetzt ist...
-            if (field[xp][yp] == 0) {
+            if (field_free(xp, yp)) {
               // Dann besetzen ("X" fuer Spieler 1, "O" fuer Spieler 2)
               // setx setzt die Tile "X" oder "O" ins jeweilige Feld auf den Bildschirm
-              // In field wird der interne Zustand des Spielfelds aktualisiert
+              // set_stone aktualisiert den internen Zustand des Spielfelds
+              // und das Ergebnis fuer check_win() und full()
               // Danach ist der jeweils andere Spieler dran
-              if (player == 1) { setx(xp, yp); field[xp][yp] = 1; player = 2; } 
-              else if (player == 2) { seto(xp, yp); field[xp][yp] = 2; player = 1; }
+              if (player == 1) { setx(xp, yp); set_stone(1, xp, yp); player = 2; } 
+              else if (player == 2) { seto(xp, yp); set_stone(2, xp, yp); player = 1; }
             }
           }
       }
@@ -527,6 +1951,9 @@ void main(void) {
       // Pruefe nach jedem Zug, ob Spieler 1 oder 2 gewonnen hat
       // und setze entsprechenden Text links oben auf den Bildschirm
       // Setze dann Flag zum Beenden der Schleife
+      // (check_win() und full() liefern nur das in set_stone() berechnete
+      // Ergebnis, kosten pro Frame also fast nichts)
+      PROF_BEGIN(PROF_WIN);
       if (check_win() == 1) {
         gbputcxy(0, 0, '@');
         gbputcxy(1, 0, '1');
@@ -546,6 +1973,11 @@ void main(void) {
         gbputcxy(1, 0, '0');
         end = 1;
       }
+      PROF_END(PROF_WIN);
+
+      // Langwierige Arbeit (Aufgaben, siehe sched_run()) bekommt den
+      // Rest des Frames
+      sched_run();
     }
 
     // Wir kommen hier an, wenn ein Spieler gewonnen hat oder das Spiel
@@ -557,15 +1989,30 @@ void main(void) {
     // Anzeige fuer den aktuellen Spieler ausblenden
     gbputcxy(10, 0, 0x00);
 
-    wait_for_display();
-    wait_for_vblank();
-  
-    // Action-Buttons abfragen
-    *BUTTONS = 0xdf;
-
     // Warte auf START-Button, bevor neues Spiel gestartet wird
-    while ((~*BUTTONS & 0xf) != 0x08);
-    gbputcxy(0, 0, ' ');
-    gbputcxy(1, 0, ' ');
+    // (B: naechster Spielmodus, dann ebenfalls neues Spiel)
+    // Die CPU schlaeft dabei tief: Sind die letzten Ausgaben im VRAM,
+    // wird der VBlank-Interrupt abgeschaltet, nur noch ein Tastendruck
+    // (Joypad-Interrupt) weckt sie auf. Die Tasten werden dann hier
+    // gelesen, der VBlank-Interrupt tut es ja gerade nicht.
+    while (vq_head != vq_tail) halt_cpu();
+    joy_flush();
+    *IRQEN = IRQ_JOYPAD;
+    do {
+      halt_cpu();
+      joy_read();
+      ev = joy_event();
+    } while (!(ev & (J_START | J_B)));
+
+    if (ev & J_B)
+      set_game_mode(game_mode + 1 == GAME_MODES ? 0 : game_mode + 1);
+
+    // Ein VBlank-Flag von vorhin wuerde den Interrupt mitten im Bild
+    // ausloesen (OAM-DMA!), also erst loeschen
+    *IRQFLAGS &= ~IRQ_VBLANK;
+    *IRQEN = IRQ_VBLANK | IRQ_JOYPAD;
+
+    // Die Wartezeit nicht als Cursorbewegung nachholen
+    last_frame = frames();
   }
 }
@@ -0,0 +1,44 @@
+/* Declarations shared by cart.c and the tools on the PC: host.c (make
+ * host) calls into the game logic, gbbench.c and script.c use the
+ * joypad bits. Plain C, so sdcc reads it as well. */
+
+/* Sprite attributes as in OAM (4 bytes) */
+typedef struct {
+  unsigned char y, x, tile, flags;
+} sprite_t;
+
+/* Joypad bits of joy_state/joy_pressed, as read by joy_read() */
+enum JOY_BIT {
+  J_RIGHT = 0x01,
+  J_LEFT = 0x02,
+  J_UP = 0x04,
+  J_DOWN = 0x08,
+  J_A = 0x10,
+  J_B = 0x20,
+  J_SELECT = 0x40,
+  J_START = 0x80
+};
+
+/* The parts of cart.c the host self-test uses */
+extern sprite_t shadow_oam[40];
+extern unsigned int stones[2], pos_index;
+extern unsigned char winner, board_full;
+extern const unsigned char cell_x[9], cell_y[9];
+extern const unsigned char pixel_to_cell[256];
+extern const unsigned char tiles_map[256];
+extern unsigned char board_m, board_n, board_k;
+extern unsigned char mnk_board[15][16];
+
+void init(void);
+void vblank_isr(void);
+void clear_field(void);
+int field_free(int x, int y);
+void set_stone(int player, int x, int y);
+int check_win(void);
+int full(void);
+unsigned char ai_move(void);
+void set_game_mode(unsigned char mode);
+void mnk_clear_field(void);
+void mnk_set_stone(unsigned char player, unsigned char x, unsigned char y);
+unsigned int mul8(unsigned char a, unsigned char b);
+unsigned char divmod8(unsigned char a, unsigned char b, unsigned char *r);
@@ -1,148 +1,713 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-unsigned char tiles[256][16];
+/* Converts a text tile file (tiles.til) into tile data for the cart.
+ *
+ * The input is read into memory in one go and parsed line by line:
+ *   # comment
+ *   @ name          starts tileset "name"; tiles before the first "@"
+ *                   belong to the set named on the command line
+ *   > 'A' 'B' 300   names of the tiles that follow side by side: a
+ *                   character in quotes or a number up to 65535 (decimal,
+ *                   0x hex or 0 octal), then a header line and 8 pixel
+ *                   rows: row digit, then one pixel every other column
+ *                   (' ' or 0, '-' or 1, '+' or 2, 'X', '*' or 3)
+ *   = name          screen layout: quoted rows of tile names (characters)
+ *                   up to an empty line
+ *
+ * Every set is written with its own symbols: <set>_count, the tiles
+ * (<set> or, with -z, <set>_packed), <set>_map (tile name -> tile number)
+ * and <set>_<screen>. A set of up to 256 distinct tiles uses bytes
+ * throughout, as the cart expects; larger sets (CGB or banked VRAM) get
+ * 16-bit tile numbers and counts. */
 
-void read_tiles(FILE *in) {
-  /* We can have multiple tiles side-by-side on a line. This is the set we are
-   * currently reading. */
-  unsigned char reading[256];
-  int n_reading, col, row, line = 1;
+#define MAX_NAMES 65536
+#define MAX_SCREEN 32
 
-  enum {
-    S_NORMAL, S_COMMENT, S_NAMES, S_NAME_CHAR, S_NAME_AFTERCHAR, S_NAME_NUM,
-    S_TILES, S_TILE_IGNORE, S_TILE_PIX, S_TILE_HEADLINE, S_ERROR
-  } state = S_NORMAL;
+/* Screen layouts: written as width, height and the tile numbers row by
+ * row, ready to be copied into a tile map. */
+struct screen {
+  char name[32];
+  int w, h;
+  unsigned char names[MAX_SCREEN][MAX_SCREEN];
+};
 
-  int comment = 0;
-  char c;
+struct tileset {
+  char name[64];
 
-  // Clear the tiles.
-  memset(tiles, 0, sizeof(tiles));
+  /* Tiles in the order they were defined; by_name[] indexes them, -1
+   * for names that were never defined. */
+  unsigned char (*tiles)[16];
+  int n_tiles, cap_tiles;
+  int *by_name;
+  int map_size;  /* names covered by the map: at least 256 */
 
-  while ((c = fgetc(in)) != EOF) {
-    if (c == '\n') ++line;
+  struct screen *screens;
+  int n_screens, cap_screens;
 
-    if (state == S_NORMAL) {
-      if (c == '>') {
-        n_reading = 0;
-        state = S_NAMES;
-      } else if (c == '#') {
-        state = S_COMMENT;
-      } else if (c == ' ' || c == '\n') {
-        /* Ignore whitespace. */
-      } else {
-        state = S_ERROR;
-      }
-    } else if (state == S_COMMENT) {
-      if (c == '\n') state = S_NORMAL;
-    } else if (state == S_NAMES) {
-      if (c == ' ') {
-      } else if (c == '\'') {
-        state = S_NAME_CHAR;
-      } else if (c >= '0' && c <= '9') {
-        state = S_NAME_NUM;
-        ungetc(c, in);
-      } else if (c == '\n') {
-        state = S_TILE_HEADLINE;
-      } else {
-        state = S_ERROR;
+  /* After dedupe: the distinct tiles (index = tile number in VRAM) and
+   * the tile number for every name. Tile 0 is always the blank tile;
+   * names that were never defined map to it. */
+  unsigned char (*uniq)[16];
+  unsigned *remap;
+  int n_uniq;
+
+  /* Packed tile data (-z), see pack_tiles() */
+  unsigned char *packed;
+  int n_packed;
+  long unpack_cycles;
+};
+
+struct tileset *sets;
+int n_sets;
+
+void *xrealloc(void *p, size_t n) {
+  p = realloc(p, n ? n : 1);
+  if (!p) {
+    fputs("Out of memory.\n", stderr);
+    exit(1);
+  }
+  return p;
+}
+
+struct tileset *find_set(const char *name) {
+  struct tileset *set;
+  int i;
+
+  for (i = 0; i < n_sets; ++i)
+    if (!strcmp(sets[i].name, name)) return &sets[i];
+
+  sets = xrealloc(sets, (n_sets + 1) * sizeof(*sets));
+  set = &sets[n_sets++];
+  memset(set, 0, sizeof(*set));
+  strcpy(set->name, name);
+  set->by_name = xrealloc(0, MAX_NAMES * sizeof(int));
+  memset(set->by_name, 0xff, MAX_NAMES * sizeof(int));
+  set->map_size = 256;
+  return set;
+}
+
+/* A fresh, blank tile for name; a name defined twice keeps the second
+ * drawing. */
+unsigned char *define_tile(struct tileset *set, int name) {
+  int i = set->by_name[name];
+
+  if (i < 0) {
+    if (set->n_tiles == set->cap_tiles) {
+      set->cap_tiles = set->cap_tiles ? 2 * set->cap_tiles : 256;
+      set->tiles = xrealloc(set->tiles, set->cap_tiles * 16);
+    }
+    i = set->by_name[name] = set->n_tiles++;
+    if (name >= set->map_size) set->map_size = (name + 16) & ~15;
+  }
+  memset(set->tiles[i], 0, 16);
+  return set->tiles[i];
+}
+
+/* --- Parser --- */
+
+char *text;
+long text_len;
+
+/* The whole input, from a file or stdin, with a NUL after it so strtol()
+ * stops at the end */
+void read_input(FILE *in) {
+  long cap = 1 << 16;
+  size_t n;
+
+  text = xrealloc(0, cap);
+  while ((n = fread(text + text_len, 1, cap - 1 - text_len, in)) > 0) {
+    text_len += n;
+    if (text_len == cap - 1) text = xrealloc(text, cap *= 2);
+  }
+  text[text_len] = 0;
+}
+
+const char *cur, *text_end;
+int line;
+
+/* Next line as [*s, *e) without the newline (or a CR before it) */
+int next_line(const char **s, const char **e) {
+  const char *nl;
+
+  if (cur >= text_end) return 0;
+  nl = memchr(cur, '\n', text_end - cur);
+  if (!nl) nl = text_end;
+  *s = cur;
+  *e = nl > cur && nl[-1] == '\r' ? nl - 1 : nl;
+  cur = nl + 1;
+  ++line;
+  return 1;
+}
+
+void parse_error(void) {
+  fprintf(stderr, "Parsing error on line %d.\n", line);
+  exit(1);
+}
+
+const char *skip_spaces(const char *p, const char *e) {
+  while (p < e && *p == ' ') ++p;
+  return p;
+}
+
+/* Identifier after "@" or "=", up to n - 1 characters */
+void parse_name(const char *p, const char *e, char *name, int n) {
+  int len = 0;
+
+  for (p = skip_spaces(p, e); p < e && *p != ' '; ++p) {
+    if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+          (*p >= '0' && *p <= '9') || *p == '_') || len == n - 1) parse_error();
+    name[len++] = *p;
+  }
+  name[len] = 0;
+  if (!len || skip_spaces(p, e) != e) parse_error();
+}
+
+/* Tiles side by side: the names on the ">" line, the header line, then
+ * eight pixel rows */
+void parse_tiles(struct tileset *set, const char *p, const char *e) {
+  static int *reading;
+  static int cap_reading;
+  int n_reading = 0, row, col;
+  const char *s;
+
+  while ((p = skip_spaces(p, e)) < e) {
+    long name;
+
+    if (*p == '\'') {
+      if (e - p < 3 || p[2] != '\'') parse_error();
+      name = (unsigned char)p[1];
+      p += 3;
+    } else {
+      char *num_end;
+      if (*p < '0' || *p > '9') parse_error();
+      name = strtol(p, &num_end, 0);
+      if (num_end > e || name >= MAX_NAMES) parse_error();
+      p = num_end;
+    }
+    if (p < e && *p != ' ') parse_error();
+
+    if (n_reading == cap_reading) {
+      cap_reading = cap_reading ? 2 * cap_reading : 16;
+      reading = xrealloc(reading, cap_reading * sizeof(*reading));
+    }
+    reading[n_reading++] = name;
+    define_tile(set, name);
+  }
+
+  if (!next_line(&s, &e)) parse_error();  /* header "  7 6 5 ..." */
+
+  for (row = 0; row < 8; ++row) {
+    if (!next_line(&s, &e) || s == e || *s < '0' || *s > '7') parse_error();
+
+    for (p = s + 2, col = 0; p < e; p += 2, ++col) {
+      unsigned char *t, bit = 0x80 >> (col % 8);
+
+      if (*p == ' ' || *p == '0') continue;
+      if (col / 8 >= n_reading) parse_error();
+      t = set->tiles[set->by_name[reading[col / 8]]] + row * 2;
+      if (*p == '-' || *p == '1') t[0] |= bit;
+      else if (*p == '+' || *p == '2') t[1] |= bit;
+      else if (*p == 'X' || *p == '*' || *p == '3') t[0] |= bit, t[1] |= bit;
+      else parse_error();
+    }
+  }
+}
+
+/* Screen rows up to an empty line (or the end of the input) */
+void parse_screen(struct tileset *set, const char *p, const char *e) {
+  struct screen *scr;
+  const char *s;
+
+  if (set->n_screens == set->cap_screens) {
+    set->cap_screens = set->cap_screens ? 2 * set->cap_screens : 4;
+    set->screens = xrealloc(set->screens, set->cap_screens * sizeof(*scr));
+  }
+  scr = &set->screens[set->n_screens++];
+  memset(scr, 0, sizeof(*scr));
+  parse_name(p, e, scr->name, sizeof(scr->name));
+
+  while (next_line(&s, &e)) {
+    int col = 0;
+
+    p = skip_spaces(s, e);
+    if (p == e) break;
+    if (*p != '"' || scr->h == MAX_SCREEN) parse_error();
+
+    for (++p; p < e && *p != '"'; ++p) {
+      if (col == MAX_SCREEN) parse_error();
+      scr->names[scr->h][col++] = *p;
+    }
+    if (p == e || skip_spaces(p + 1, e) != e) parse_error();
+
+    if (col > scr->w) scr->w = col;
+    ++scr->h;
+  }
+}
+
+void parse(const char *default_set) {
+  struct tileset *set = find_set(default_set);
+  const char *s, *e, *p;
+
+  cur = text;
+  text_end = text + text_len;
+  line = 0;
+
+  while (next_line(&s, &e)) {
+    p = skip_spaces(s, e);
+    if (p == e || *p == '#') continue;
+
+    if (*p == '>') {
+      parse_tiles(set, p + 1, e);
+    } else if (*p == '=') {
+      parse_screen(set, p + 1, e);
+    } else if (*p == '@') {
+      char name[sizeof(set->name)];
+      parse_name(p + 1, e, name, sizeof(name));
+      set = find_set(name);
+    } else {
+      parse_error();
+    }
+  }
+}
+
+/* --- Dedupe --- */
+
+unsigned hash_tile(const unsigned char *t) {
+  unsigned h = 2166136261u;
+  int i;
+
+  for (i = 0; i < 16; ++i) h = (h ^ t[i]) * 16777619u;
+  return h;
+}
+
+/* Keep only defined tiles and merge identical ones, in name order. A
+ * hash table of the distinct tiles keeps this linear in the number of
+ * tiles. */
+void dedupe_tiles(struct tileset *set) {
+  int size = 16, *slots, name, i;
+
+  while (size < 2 * (set->n_tiles + 1)) size *= 2;
+  slots = xrealloc(0, size * sizeof(int));
+  memset(slots, 0xff, size * sizeof(int));
+
+  set->uniq = xrealloc(0, (set->n_tiles + 1) * 16);
+  set->remap = xrealloc(0, set->map_size * sizeof(unsigned));
+  memset(set->uniq[0], 0, 16);
+  slots[hash_tile(set->uniq[0]) & (size - 1)] = 0;
+  set->n_uniq = 1;
+
+  for (name = 0; name < set->map_size; ++name) {
+    const unsigned char *t;
+
+    set->remap[name] = 0;
+    if (set->by_name[name] < 0) continue;
+    t = set->tiles[set->by_name[name]];
+
+    for (i = hash_tile(t) & (size - 1); slots[i] >= 0; i = (i + 1) & (size - 1))
+      if (!memcmp(set->uniq[slots[i]], t, 16)) break;
+
+    if (slots[i] < 0) {
+      if (set->n_uniq == MAX_NAMES) {
+        fprintf(stderr, "More than %d distinct tiles.\n", MAX_NAMES);
+        exit(1);
       }
-    } else if (state == S_NAME_NUM) {
-      int i;
-      fscanf(in, "%i", &i);
-      reading[n_reading++] = i;
-    } else if (state == S_NAME_CHAR) {
-      reading[n_reading++] = c;
-      state = S_NAME_AFTERCHAR;
-    } else if (state == S_NAME_AFTERCHAR) {
-      if (c == '\'') state = S_NAMES;
-      else state = S_ERROR;
-    } else if (state == S_TILE_HEADLINE) {
-      row = -1;
-      if (c == '\n') state = S_TILES;
-    } else if (state == S_TILES) {
-      row++;
-      if (c >= '0' && c <= '7') {
-        col = 0;
-        state = S_TILE_IGNORE;
-      } else {
-        state = S_ERROR;
+      memcpy(set->uniq[set->n_uniq], t, 16);
+      slots[i] = set->n_uniq++;
+    }
+    set->remap[name] = slots[i];
+  }
+
+  free(slots);
+}
+
+/* Compress the distinct tiles for unpack() in cart.c. The stream is a
+ * sequence of commands:
+ *   0x00                 end
+ *   0x01-0x7f n          n literal bytes follow
+ *   0x80-0xbf            repeat the next byte (cmd & 0x3f) + 2 times
+ *   0xc0-0xff o          copy (cmd & 0x3f) + 3 bytes starting o + 1 bytes
+ *                        back in the output (may overlap the output)
+ * In 2bpp data the two bitplanes of a row usually differ, but whole rows
+ * repeat (vertical lines, blank rows), which a copy from 2 bytes back
+ * covers in a single command.
+ *
+ * Also counts the CPU cycles unpack() in cart.c needs; the per-command
+ * costs are taken from its instruction timings (M-cycles * 4). */
+#define CYC_START (4*20)
+#define CYC_END (4*8)
+#define CYC_LIT(n) (4*(12 + 10*(n)))
+#define CYC_RUN(n) (4*(23 + 8*(n)))
+#define CYC_COPY(n) (4*(38 + 10*(n)))
+
+void flush_literals(struct tileset *set, const unsigned char *data,
+                    int start, int n) {
+  if (!n) return;
+  set->packed[set->n_packed++] = n;
+  memcpy(set->packed + set->n_packed, data + start, n);
+  set->n_packed += n;
+  set->unpack_cycles += CYC_LIT(n);
+}
+
+void pack_tiles(struct tileset *set) {
+  const unsigned char *data = set->uniq[0];
+  int len = set->n_uniq * 16, pos = 0, lit_start = 0;
+
+  /* Worst case is one literal command byte per 127 bytes plus the end
+   * marker. */
+  set->packed = xrealloc(0, len + len / 127 + 2);
+  set->n_packed = 0;
+  set->unpack_cycles = CYC_START;
+
+  while (pos < len) {
+    int run = 1, copy = 0, copy_off = 0, off;
+
+    while (pos + run < len && run < 65 && data[pos + run] == data[pos]) ++run;
+
+    for (off = 1; off <= 256 && off <= pos; ++off) {
+      int n = 0;
+      while (pos + n < len && n < 66 && data[pos + n] == data[pos - off + n]) ++n;
+      if (n > copy) {
+        copy = n;
+        copy_off = off;
       }
-    } else if (state == S_TILE_IGNORE) {
-      if (c == '\n') {
-        if (row == 7) state = S_NORMAL;
-        else state = S_TILES;
-      } else {
-        state = S_TILE_PIX;
+    }
+
+    if (copy >= 3 && copy >= run) {
+      flush_literals(set, data, lit_start, pos - lit_start);
+      set->packed[set->n_packed++] = 0xc0 | (copy - 3);
+      set->packed[set->n_packed++] = copy_off - 1;
+      set->unpack_cycles += CYC_COPY(copy);
+      pos += copy;
+      lit_start = pos;
+    } else if (run >= 3) {
+      flush_literals(set, data, lit_start, pos - lit_start);
+      set->packed[set->n_packed++] = 0x80 | (run - 2);
+      set->packed[set->n_packed++] = data[pos];
+      set->unpack_cycles += CYC_RUN(run);
+      pos += run;
+      lit_start = pos;
+    } else {
+      ++pos;
+      if (pos - lit_start == 127) {
+        flush_literals(set, data, lit_start, 127);
+        lit_start = pos;
       }
-    } else if (state == S_TILE_PIX) {
-      if (c == ' ' || c == '0') {
-        /* Do nothing; already cleared. */
-      } else if (c == '-' || c == '1') {
-        tiles[reading[col/8]][row*2 + 0] |= (0x80>>(col%8));
-      } else if (c == '+' || c == '2') {
-        tiles[reading[col/8]][row*2 + 1] |= (0x80>>(col%8));
-      } else if (c == 'X' || c == '*' || c == '3') {
-        tiles[reading[col/8]][row*2 + 0] |= (0x80>>(col%8));
-        tiles[reading[col/8]][row*2 + 1] |= (0x80>>(col%8));
-      } else if (c == '\n') {
-        if (row == 7) state = S_NORMAL;
-        else state = S_TILES;
-      } else {
-        state = S_ERROR;
+    }
+  }
+
+  flush_literals(set, data, lit_start, pos - lit_start);
+  set->packed[set->n_packed++] = 0;
+  set->unpack_cycles += CYC_END;
+}
+
+/* --- Output --- */
+
+/* Sets of more than 256 tiles need 16-bit tile numbers, and their count
+ * no longer fits a byte from 256 tiles on. */
+int wide(const struct tileset *set) {
+  return set->n_uniq > 256;
+}
+
+const char *count_type(const struct tileset *set) {
+  return set->n_uniq > 255 ? "unsigned int" : "unsigned char";
+}
+
+void write_map(FILE *out, const struct tileset *set) {
+  int i, n = set->map_size;
+
+  /* Name (e.g. ASCII code) -> tile number */
+  fprintf(out, "const unsigned %s %s_map[%d] = {\n",
+          wide(set) ? "int" : "char", set->name, n);
+
+  for (i = 0; i < n; ++i) {
+    if (i % 16 == 0) fputs("  ", out);
+    fprintf(out, wide(set) ? "%5u" : "%3u", set->remap[i]);
+    if (i != n - 1) fputc(',', out);
+    if (i % 16 == 15) fprintf(out, " /* 0x%02x */\n", i & ~15); else fputc(' ', out);
+  }
+
+  fputs("};\n", out);
+}
+
+/* Tile number at (x,y) of a screen; short rows are padded with blanks. */
+unsigned screen_tile(const struct tileset *set, const struct screen *scr,
+                     int x, int y) {
+  unsigned char c = scr->names[y][x];
+  return set->remap[c ? c : ' '];
+}
+
+void write_screens(FILE *out, const struct tileset *set) {
+  int i, x, y;
+
+  for (i = 0; i < set->n_screens; ++i) {
+    const struct screen *scr = &set->screens[i];
+
+    fprintf(out, "\n/* Screen \"%s\": width, height, tiles */\n", scr->name);
+    fprintf(out, "const unsigned %s %s_%s[%d] = {\n  %d, %d,\n",
+            wide(set) ? "int" : "char", set->name, scr->name,
+            2 + scr->w * scr->h, scr->w, scr->h);
+
+    for (y = 0; y < scr->h; ++y) {
+      fputs("  ", out);
+      for (x = 0; x < scr->w; ++x) {
+        fprintf(out, "%u", screen_tile(set, scr, x, y));
+        if (y != scr->h - 1 || x != scr->w - 1) fputc(',', out);
+        if (x != scr->w - 1) fputc(' ', out);
       }
-      col++;
-      state = S_TILE_IGNORE;
-    } else if (state == S_ERROR) {
-      fprintf(stderr, "Parsing error on line %d.\n", line);
-      exit(1);
+      fputc('\n', out);
     }
+
+    fputs("};\n", out);
   }
 }
 
-void write_tiles(FILE *out, const char *name) {
+void write_packed(FILE *out, const struct tileset *set) {
+  int i;
+  char macro[80];
+
+  /* Lets the cart pick the matching copy routine. */
+  for (i = 0; set->name[i]; ++i)
+    macro[i] = (set->name[i] >= 'a' && set->name[i] <= 'z') ?
+               set->name[i] - 'a' + 'A' : set->name[i];
+  strcpy(macro + i, "_PACKED");
+
+  fprintf(out, "#ifndef %s\n#define %s\n#endif\n\n", macro, macro);
+  fprintf(out, "const %s %s_count = %d;\n\n", count_type(set), set->name,
+          set->n_uniq);
+  fprintf(out, "const unsigned char %s_packed[%d] = {\n", set->name,
+          set->n_packed);
+
+  for (i = 0; i < set->n_packed; ++i) {
+    if (i % 16 == 0) fputs("  ", out);
+    fprintf(out, "0x%02x", set->packed[i]);
+    if (i != set->n_packed - 1) fputc(',', out);
+    if (i % 16 == 15 || i == set->n_packed - 1) fputc('\n', out); else fputc(' ', out);
+  }
+
+  fputs("};\n\n", out);
+
+  write_map(out, set);
+  write_screens(out, set);
+}
+
+void write_tiles(FILE *out, const struct tileset *set) {
   int i, j;
 
-  fprintf(out, "const unsigned char %s[256][16] = {\n", name);
+  fprintf(out, "const %s %s_count = %d;\n\n", count_type(set), set->name,
+          set->n_uniq);
+  fprintf(out, "const unsigned char %s[%d][16] = {\n", set->name, set->n_uniq);
 
-  for (i = 0; i < 256; ++i) {
+  for (i = 0; i < set->n_uniq; ++i) {
     fputs("  {", out);
     for (j = 0; j < 16; ++j) {
-      fprintf(out, "0x%02x", tiles[i][j]);
+      fprintf(out, "0x%02x", set->uniq[i][j]);
       if (j != 15) {
         fputs(", ", out);
       } else {
         fputc('}', out);
-        if (i == 255) fputc(' ', out); else fputc(',', out);
+        if (i == set->n_uniq - 1) fputc(' ', out); else fputc(',', out);
       }
     }
-    fprintf(out, " /* 0x%02x */\n", i);
+    fprintf(out, " /* %d */\n", i);
   }
 
-  fputs("};\n", out);
+  fputs("};\n\n", out);
+
+  write_map(out, set);
+  write_screens(out, set);
+}
+
+/* Assembler output: the same symbols as the C output, as .byte (or .dw
+ * for 16-bit tile numbers) blocks for sdasgb, so the tile data is linked
+ * in without going through sdcc. */
+void write_asm_bytes(FILE *out, const unsigned char *data, int n) {
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    if (i % 16 == 0) fputs("  .byte ", out);
+    fprintf(out, "0x%02x", data[i]);
+    if (i % 16 == 15 || i == n - 1) fputc('\n', out); else fputc(',', out);
+  }
+}
+
+void write_asm_words(FILE *out, const unsigned *data, int n) {
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    if (i % 16 == 0) fputs("  .dw ", out);
+    fprintf(out, "0x%04x", data[i]);
+    if (i % 16 == 15 || i == n - 1) fputc('\n', out); else fputc(',', out);
+  }
+}
+
+/* Tile numbers as bytes or words, depending on the set */
+void write_asm_numbers(FILE *out, const struct tileset *set,
+                       const unsigned *data, int n) {
+  unsigned char bytes[256];
+  int i, j;
+
+  if (wide(set)) {
+    write_asm_words(out, data, n);
+    return;
+  }
+  for (i = 0; i < n; i += 256) {
+    for (j = 0; j < 256 && i + j < n; ++j) bytes[j] = data[i + j];
+    write_asm_bytes(out, bytes, j);
+  }
+}
+
+void write_asm(FILE *out, const struct tileset *set, int pack) {
+  unsigned count = set->n_uniq, row[MAX_SCREEN], size[2];
+  int i, x, y;
+
+  fprintf(out, "_%s_count::\n", set->name);
+  if (set->n_uniq > 255) write_asm_words(out, &count, 1);
+  else write_asm_numbers(out, set, &count, 1);
+
+  if (pack) {
+    fprintf(out, "\n_%s_packed::\n", set->name);
+    write_asm_bytes(out, set->packed, set->n_packed);
+  } else {
+    fprintf(out, "\n_%s::\n", set->name);
+    write_asm_bytes(out, set->uniq[0], set->n_uniq * 16);
+  }
+
+  fprintf(out, "\n_%s_map::\n", set->name);
+  write_asm_numbers(out, set, set->remap, set->map_size);
+
+  for (i = 0; i < set->n_screens; ++i) {
+    const struct screen *scr = &set->screens[i];
+
+    fprintf(out, "\n; Screen \"%s\": width, height, tiles\n", scr->name);
+    fprintf(out, "_%s_%s::\n", set->name, scr->name);
+    size[0] = scr->w;
+    size[1] = scr->h;
+    write_asm_numbers(out, set, size, 2);
+
+    for (y = 0; y < scr->h; ++y) {
+      for (x = 0; x < scr->w; ++x) row[x] = screen_tile(set, scr, x, y);
+      write_asm_numbers(out, set, row, scr->w);
+    }
+  }
+}
+
+/* Raw 2bpp image of the distinct tiles, for other tools. */
+int write_2bpp(const char *path, const struct tileset *set) {
+  FILE *f = fopen(path, "wb");
+
+  if (!f) return 0;
+  fwrite(set->uniq[0], 16, set->n_uniq, f);
+  fclose(f);
+
+  return 1;
+}
+
+int ends_with(const char *s, const char *suffix) {
+  size_t n = strlen(s), m = strlen(suffix);
+  return n >= m && !strcmp(s + n - m, suffix);
+}
+
+double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
 }
 
 int main(int argc, char **argv) {
-  FILE *f_in = argc > 1 ? fopen(argv[1], "r") : stdin;
+  /* -z: write packed tiles (for unpack() in cart.c) */
+  int pack = argc > 1 && !strcmp(argv[1], "-z");
+  if (pack) {
+    --argc;
+    ++argv;
+  }
+
+  const char *default_set = argc > 3 ? argv[3] : "tiles";
+  FILE *f_in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+  double t_start, t_parse;
+  long n_defined = 0;
+  int i, first = 0;
 
   if (!f_in) {
     fputs("Could not open input file.\n", stderr);
     return 1;
   }
-  
-  read_tiles(f_in);
+  if (strlen(default_set) >= sizeof(sets->name)) {
+    fputs("Tileset name too long.\n", stderr);
+    return 1;
+  }
+
+  t_start = now_ms();
+  read_input(f_in);
   fclose(f_in);
+  parse(default_set);
+  t_parse = now_ms() - t_start;
+
+  /* Tiles before the first "@" go to the set named on the command line;
+   * if there are none, that set is left out (unless it is the only one). */
+  if (n_sets > 1 && !sets[0].n_tiles && !sets[0].n_screens) first = 1;
+
+  for (i = first; i < n_sets; ++i) {
+    struct tileset *set = &sets[i];
+
+    n_defined += set->n_tiles;
+    dedupe_tiles(set);
+    fprintf(stderr, "%s: %d distinct tiles (%d bytes)\n", set->name,
+            set->n_uniq, set->n_uniq * 16);
+
+    if (pack) {
+      pack_tiles(set);
+      fprintf(stderr, "%s: packed to %d bytes (%d%%), unpacking takes %ld "
+              "cycles (%ld per tile)\n", set->name, set->n_packed,
+              set->n_packed * 100 / (set->n_uniq * 16), set->unpack_cycles,
+              set->unpack_cycles / set->n_uniq);
+    }
+  }
+
+  fprintf(stderr, "parsed %ld bytes, %ld tiles in %d sets in %.1f ms "
+          "(%.1f MB/s, %.0f tiles/s)\n", text_len, n_defined, n_sets - first,
+          t_parse, t_parse > 0 ? text_len / t_parse / 1e3 : 0,
+          t_parse > 0 ? n_defined / t_parse * 1e3 : 0);
 
   FILE *f_out = argc > 2 ? fopen(argv[2], "w") : stdout;
 
   if (!f_out) {
-    fputs("Could not open input file.\n", stderr);
+    fputs("Could not open output file.\n", stderr);
     return 1;
   }
-  
-  write_tiles(f_out, argc > 3 ? argv[3] : "tiles");
+
+  /* An output file ending in .asm gets the assembler stub, with the raw
+   * tiles written next to it as .2bpp (<out>.2bpp for the first set,
+   * <out>.<set>.2bpp for the others). */
+  if (argc > 2 && ends_with(argv[2], ".asm")) {
+    size_t n = strlen(argv[2]) - 4;
+    char *path = xrealloc(0, n + sizeof(sets->name) + 8);
+
+    fprintf(f_out, "; Generated by convtiles, do not edit.\n");
+    fprintf(f_out, ".area _CODE\n\n");
+
+    for (i = first; i < n_sets; ++i) {
+      memcpy(path, argv[2], n);
+      if (i == first) strcpy(path + n, ".2bpp");
+      else sprintf(path + n, ".%s.2bpp", sets[i].name);
+
+      if (!write_2bpp(path, &sets[i])) {
+        fputs("Could not open output file.\n", stderr);
+        return 1;
+      }
+      if (i != first) fputc('\n', f_out);
+      write_asm(f_out, &sets[i], pack);
+    }
+    free(path);
+  } else {
+    for (i = first; i < n_sets; ++i) {
+      if (i != first) fputc('\n', f_out);
+      if (pack) write_packed(f_out, &sets[i]);
+      else write_tiles(f_out, &sets[i]);
+    }
+  }
   fclose(f_out);
 
   return 0;
@@ -0,0 +1,877 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cart.h"
+#include "script.h"
+
+/* Headless cycle counter for cart.gb.
+ *
+ * Runs the ROM on a minimal SM83 model (CPU, LY/LCDSTAT timing, VBlank
+ * interrupt, joypad, DIV, OAM DMA, MBC1/MBC5 ROM banking) and reports how
+ * many cycles functions, regions and main loop iterations take. Symbols
+ * come from the linker's .noi (or .map) file. Input is replayed from a
+ * script; see script.c.
+ *
+ * Timing is per instruction: all memory accesses of an instruction are
+ * treated as happening at its start. That is exact for cycle totals and
+ * good enough to flag VRAM/OAM writes while the LCD controller owns them.
+ *
+ * The report is one line per measurement, "kind name key=value ...", and
+ * can be compared with an earlier report (-b) to fail on regressions. */
+
+#define CYCLES_PER_LINE 456
+#define LINES_PER_FRAME 154
+#define CYCLES_PER_FRAME (CYCLES_PER_LINE * LINES_PER_FRAME)
+
+#define MAX_TRACK 64
+#define MAX_SEGS 1024
+#define MAX_DEPTH 256
+
+enum { FZ = 0x80, FN = 0x40, FH = 0x20, FC = 0x10 };
+
+/* --- Machine state --- */
+
+unsigned char *rom;
+unsigned long rom_size;
+unsigned rom_bank = 1;
+
+unsigned char vram[0x2000], wram[0x2000], oam[0xa0], io[0x80], hram[0x80];
+unsigned char ie;
+
+unsigned char a, f, b, c, d, e, h, l;
+unsigned sp, pc;
+int ime, ime_pending, halted;
+
+unsigned long long cycles, idle_cycles;
+unsigned div_counter;
+unsigned line_cycles, ly;
+unsigned char joy_state; /* J_* bits, 1 = pressed */
+
+unsigned long vram_violations, oam_violations;
+int crashed;
+
+/* --- Measurements --- */
+
+struct track {
+  char name[64];
+  unsigned long addr;
+  int kind; /* 'f' function, 'i' iteration marker, 'r' region start/end */
+  unsigned long calls;
+  unsigned long long total, min, max;
+  unsigned long long last, last_idle, busy_max;
+} tracks[MAX_TRACK];
+int n_tracks;
+
+/* Set for addresses of tracked symbols. */
+unsigned char track_at[0x10000];
+
+struct frame {
+  int t;
+  unsigned sp;
+  unsigned long long start;
+} stack[MAX_DEPTH];
+int depth;
+
+struct region {
+  int from, to;
+  int started, done;
+  unsigned long long start, cycles;
+} regions[MAX_TRACK];
+int n_regions;
+
+/* Script segments and the busy cycles measured in each */
+struct script_seg segs[MAX_SEGS];
+unsigned long long seg_busy[MAX_SEGS], seg_busy_max[MAX_SEGS];
+int n_segs;
+
+/* --- Memory --- */
+
+void ppu_mode_check(unsigned addr) {
+  unsigned mode = io[0x41] & 3;
+
+  if (!(io[0x40] & 0x80)) return;
+  if (addr >= 0x8000 && addr < 0xa000 && mode == 3) ++vram_violations;
+  if (addr >= 0xfe00 && addr < 0xfea0 && mode >= 2) ++oam_violations;
+}
+
+unsigned char joypad_read(void) {
+  unsigned char v = 0x0f;
+
+  if (!(io[0x00] & 0x10)) v &= ~(joy_state & 0x0f);
+  if (!(io[0x00] & 0x20)) v &= ~(joy_state >> 4);
+  return 0xc0 | (io[0x00] & 0x30) | v;
+}
+
+unsigned char rd(unsigned addr) {
+  addr &= 0xffff;
+
+  if (addr < 0x4000) return addr < rom_size ? rom[addr] : 0xff;
+  if (addr < 0x8000) {
+    unsigned long o = (unsigned long)rom_bank * 0x4000 + addr - 0x4000;
+    return o < rom_size ? rom[o] : 0xff;
+  }
+  if (addr < 0xa000) return vram[addr - 0x8000];
+  if (addr < 0xc000) return 0xff;
+  if (addr < 0xfe00) return wram[addr & 0x1fff];
+  if (addr < 0xfea0) return oam[addr - 0xfe00];
+  if (addr < 0xff00) return 0xff;
+  if (addr == 0xff00) return joypad_read();
+  if (addr == 0xff04) return div_counter >> 8;
+  if (addr < 0xff80) return io[addr - 0xff00];
+  if (addr < 0xffff) return hram[addr - 0xff80];
+  return ie;
+}
+
+void wr(unsigned addr, unsigned char v) {
+  addr &= 0xffff;
+
+  if (addr < 0x8000) {
+    /* MBC1/MBC5 ROM bank select (low bits only). */
+    if (addr >= 0x2000 && addr < 0x3000) {
+      rom_bank = v ? v : 1;
+      if (rom_bank * 0x4000UL >= rom_size) rom_bank %= rom_size / 0x4000;
+    }
+    return;
+  }
+  ppu_mode_check(addr);
+  if (addr < 0xa000) { vram[addr - 0x8000] = v; return; }
+  if (addr < 0xc000) return;
+  if (addr < 0xfe00) { wram[addr & 0x1fff] = v; return; }
+  if (addr < 0xfea0) { oam[addr - 0xfe00] = v; return; }
+  if (addr < 0xff00) return;
+  if (addr < 0xff80) {
+    unsigned r = addr - 0xff00;
+
+    switch (r) {
+    case 0x04: div_counter = 0; return;
+    case 0x0f: io[r] = v & 0x1f; return;
+    case 0x40:
+      if ((v ^ io[r]) & 0x80) {
+        /* LCD switched on or off: restart at line 0. */
+        ly = 0;
+        line_cycles = 0;
+        io[0x41] &= ~3;
+      }
+      io[r] = v;
+      return;
+    case 0x41: io[r] = (io[r] & 7) | (v & 0x78); return;
+    case 0x44: return;
+    case 0x46: {
+      /* OAM DMA; the CPU waits for it in its HRAM routine. */
+      unsigned i;
+      for (i = 0; i < 0xa0; ++i) oam[i] = rd((v << 8) + i);
+      io[r] = v;
+      return;
+    }
+    }
+    io[r] = v;
+    return;
+  }
+  if (addr < 0xffff) { hram[addr - 0xff80] = v; return; }
+  ie = v;
+}
+
+unsigned rd16(unsigned addr) { return rd(addr) | (rd(addr + 1) << 8); }
+
+void push(unsigned v) {
+  sp = (sp - 1) & 0xffff; wr(sp, v >> 8);
+  sp = (sp - 1) & 0xffff; wr(sp, v & 0xff);
+}
+
+unsigned pop(void) {
+  unsigned v = rd(sp);
+  sp = (sp + 1) & 0xffff;
+  v |= rd(sp) << 8;
+  sp = (sp + 1) & 0xffff;
+  return v;
+}
+
+/* --- Timing --- */
+
+void set_mode(unsigned mode) {
+  io[0x41] = (io[0x41] & ~3) | mode;
+}
+
+void tick(unsigned n) {
+  cycles += n;
+  div_counter = (div_counter + n) & 0xffff;
+
+  if (!(io[0x40] & 0x80)) {
+    io[0x44] = 0;
+    set_mode(0);
+    return;
+  }
+
+  line_cycles += n;
+  while (line_cycles >= CYCLES_PER_LINE) {
+    line_cycles -= CYCLES_PER_LINE;
+    ly = (ly + 1) % LINES_PER_FRAME;
+    if (ly == 144) io[0x0f] |= 0x01;
+  }
+
+  io[0x44] = ly;
+  if (ly >= 144) set_mode(1);
+  else if (line_cycles < 80) set_mode(2);
+  else if (line_cycles < 252) set_mode(3);
+  else set_mode(0);
+
+  if (ly == io[0x45]) io[0x41] |= 4; else io[0x41] &= ~4;
+}
+
+/* --- CPU --- */
+
+static const unsigned char op_cycles[256] = {
+   4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,
+   4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,
+   8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,
+   8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+   8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+   8,12,12,16,12,16, 8,16, 8,16,12, 4,12,24, 8,16,
+   8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,
+  12,12, 8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,
+  12,12, 8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16
+};
+
+unsigned char *reg8[8] = { &b, &c, &d, &e, &h, &l, 0, &a };
+
+unsigned hl(void) { return (h << 8) | l; }
+void set_hl(unsigned v) { h = v >> 8; l = v; }
+
+unsigned char get_r(int r) { return r == 6 ? rd(hl()) : *reg8[r]; }
+void set_r(int r, unsigned char v) { if (r == 6) wr(hl(), v); else *reg8[r] = v; }
+
+unsigned get_rr(int rr) {
+  switch (rr) {
+  case 0: return (b << 8) | c;
+  case 1: return (d << 8) | e;
+  case 2: return hl();
+  }
+  return sp;
+}
+
+void set_rr(int rr, unsigned v) {
+  v &= 0xffff;
+  switch (rr) {
+  case 0: b = v >> 8; c = v; return;
+  case 1: d = v >> 8; e = v; return;
+  case 2: set_hl(v); return;
+  }
+  sp = v;
+}
+
+int cond(int cc) {
+  switch (cc) {
+  case 0: return !(f & FZ);
+  case 1: return f & FZ;
+  case 2: return !(f & FC);
+  }
+  return f & FC;
+}
+
+unsigned char fetch(void) {
+  unsigned char v = rd(pc);
+  pc = (pc + 1) & 0xffff;
+  return v;
+}
+
+unsigned fetch16(void) {
+  unsigned v = fetch();
+  return v | (fetch() << 8);
+}
+
+void alu(int op, unsigned char v) {
+  unsigned r, cy = (f & FC) ? 1 : 0;
+
+  switch (op) {
+  case 0: /* ADD */
+  case 1: /* ADC */
+    if (op == 0) cy = 0;
+    r = a + v + cy;
+    f = ((r & 0xff) ? 0 : FZ) | (((a & 0xf) + (v & 0xf) + cy) > 0xf ? FH : 0) |
+        (r > 0xff ? FC : 0);
+    a = r;
+    return;
+  case 2: /* SUB */
+  case 3: /* SBC */
+  case 7: /* CP */
+    if (op != 3) cy = 0;
+    r = a - v - cy;
+    f = FN | ((r & 0xff) ? 0 : FZ) | ((a & 0xf) < (v & 0xf) + cy ? FH : 0) |
+        (a < v + cy ? FC : 0);
+    if (op != 7) a = r;
+    return;
+  case 4: a &= v; f = (a ? 0 : FZ) | FH; return;
+  case 5: a ^= v; f = a ? 0 : FZ; return;
+  case 6: a |= v; f = a ? 0 : FZ; return;
+  }
+}
+
+int exec_cb(void) {
+  unsigned char op = fetch(), v, r;
+  int reg = op & 7, bit = (op >> 3) & 7;
+
+  v = get_r(reg);
+
+  if (op < 0x40) {
+    unsigned char cy = (f & FC) ? 1 : 0, out;
+
+    switch (bit) {
+    case 0: out = v >> 7; r = (v << 1) | out; break;          /* RLC */
+    case 1: out = v & 1; r = (v >> 1) | (out << 7); break;    /* RRC */
+    case 2: out = v >> 7; r = (v << 1) | cy; break;           /* RL */
+    case 3: out = v & 1; r = (v >> 1) | (cy << 7); break;     /* RR */
+    case 4: out = v >> 7; r = v << 1; break;                  /* SLA */
+    case 5: out = v & 1; r = (v >> 1) | (v & 0x80); break;    /* SRA */
+    case 6: out = 0; r = (v << 4) | (v >> 4); break;          /* SWAP */
+    default: out = v & 1; r = v >> 1; break;                  /* SRL */
+    }
+    f = (r ? 0 : FZ) | (out ? FC : 0);
+    set_r(reg, r);
+  } else if (op < 0x80) {
+    f = (f & FC) | FH | ((v & (1 << bit)) ? 0 : FZ);
+    return reg == 6 ? 12 : 8;
+  } else if (op < 0xc0) {
+    set_r(reg, v & ~(1 << bit));
+  } else {
+    set_r(reg, v | (1 << bit));
+  }
+
+  return reg == 6 ? 16 : 8;
+}
+
+/* Execute one instruction, return its cycles. */
+int exec(void) {
+  unsigned char op = fetch();
+  int n = op_cycles[op];
+  unsigned v, w;
+
+  if (op >= 0x40 && op < 0x80) {
+    if (op == 0x76) {
+      if (ime || !(ie & io[0x0f] & 0x1f)) halted = 1;
+      return n;
+    }
+    set_r((op >> 3) & 7, get_r(op & 7));
+    return n;
+  }
+
+  if (op >= 0x80 && op < 0xc0) {
+    alu((op >> 3) & 7, get_r(op & 7));
+    return n;
+  }
+
+  switch (op) {
+  case 0x00: break;
+  case 0x01: case 0x11: case 0x21: case 0x31:
+    set_rr(op >> 4, fetch16()); break;
+  case 0x02: wr((b << 8) | c, a); break;
+  case 0x12: wr((d << 8) | e, a); break;
+  case 0x22: wr(hl(), a); set_hl(hl() + 1); break;
+  case 0x32: wr(hl(), a); set_hl(hl() - 1); break;
+  case 0x0a: a = rd((b << 8) | c); break;
+  case 0x1a: a = rd((d << 8) | e); break;
+  case 0x2a: a = rd(hl()); set_hl(hl() + 1); break;
+  case 0x3a: a = rd(hl()); set_hl(hl() - 1); break;
+  case 0x03: case 0x13: case 0x23: case 0x33:
+    set_rr(op >> 4, get_rr(op >> 4) + 1); break;
+  case 0x0b: case 0x1b: case 0x2b: case 0x3b:
+    set_rr(op >> 4, get_rr(op >> 4) - 1); break;
+  case 0x04: case 0x0c: case 0x14: case 0x1c:
+  case 0x24: case 0x2c: case 0x34: case 0x3c:
+    v = (get_r(op >> 3) + 1) & 0xff;
+    set_r(op >> 3, v);
+    f = (f & FC) | (v ? 0 : FZ) | ((v & 0xf) == 0 ? FH : 0);
+    break;
+  case 0x05: case 0x0d: case 0x15: case 0x1d:
+  case 0x25: case 0x2d: case 0x35: case 0x3d:
+    v = (get_r(op >> 3) - 1) & 0xff;
+    set_r(op >> 3, v);
+    f = (f & FC) | FN | (v ? 0 : FZ) | ((v & 0xf) == 0xf ? FH : 0);
+    break;
+  case 0x06: case 0x0e: case 0x16: case 0x1e:
+  case 0x26: case 0x2e: case 0x36: case 0x3e:
+    set_r(op >> 3, fetch()); break;
+  case 0x07: f = (a & 0x80) ? FC : 0; a = (a << 1) | (a >> 7); break;
+  case 0x0f: f = (a & 1) ? FC : 0; a = (a >> 1) | (a << 7); break;
+  case 0x17:
+    v = (f & FC) ? 1 : 0; f = (a & 0x80) ? FC : 0; a = (a << 1) | v; break;
+  case 0x1f:
+    v = (f & FC) ? 0x80 : 0; f = (a & 1) ? FC : 0; a = (a >> 1) | v; break;
+  case 0x08: w = fetch16(); wr(w, sp); wr(w + 1, sp >> 8); break;
+  case 0x09: case 0x19: case 0x29: case 0x39:
+    v = hl(); w = get_rr(op >> 4);
+    f = (f & FZ) | (((v & 0xfff) + (w & 0xfff)) > 0xfff ? FH : 0) |
+        (v + w > 0xffff ? FC : 0);
+    set_hl(v + w);
+    break;
+  case 0x10: fetch(); break; /* STOP: treated as NOP */
+  case 0x18: v = fetch(); pc = (pc + (signed char)v) & 0xffff; break;
+  case 0x20: case 0x28: case 0x30: case 0x38:
+    v = fetch();
+    if (cond((op >> 3) & 3)) { pc = (pc + (signed char)v) & 0xffff; n += 4; }
+    break;
+  case 0x27: {
+    unsigned char cy = f & FC;
+    if (!(f & FN)) {
+      if (cy || a > 0x99) { a += 0x60; cy = FC; }
+      if ((f & FH) || (a & 0x0f) > 0x09) a += 0x06;
+    } else {
+      if (cy) a -= 0x60;
+      if (f & FH) a -= 0x06;
+    }
+    f = (a ? 0 : FZ) | (f & FN) | cy;
+    break;
+  }
+  case 0x2f: a = ~a; f |= FN | FH; break;
+  case 0x37: f = (f & FZ) | FC; break;
+  case 0x3f: f = (f & FZ) | ((f & FC) ? 0 : FC); break;
+  case 0xc0: case 0xc8: case 0xd0: case 0xd8:
+    if (cond((op >> 3) & 3)) { pc = pop(); n += 12; }
+    break;
+  case 0xc9: pc = pop(); break;
+  case 0xd9: pc = pop(); ime = 1; break;
+  case 0xc1: case 0xd1: case 0xe1:
+    set_rr((op >> 4) & 3, pop()); break;
+  case 0xf1: v = pop(); a = v >> 8; f = v & 0xf0; break;
+  case 0xc5: case 0xd5: case 0xe5:
+    push(get_rr((op >> 4) & 3)); break;
+  case 0xf5: push((a << 8) | f); break;
+  case 0xc2: case 0xca: case 0xd2: case 0xda:
+    w = fetch16();
+    if (cond((op >> 3) & 3)) { pc = w; n += 4; }
+    break;
+  case 0xc3: pc = fetch16(); break;
+  case 0xe9: pc = hl(); break;
+  case 0xc4: case 0xcc: case 0xd4: case 0xdc:
+    w = fetch16();
+    if (cond((op >> 3) & 3)) { push(pc); pc = w; n += 12; }
+    break;
+  case 0xcd: w = fetch16(); push(pc); pc = w; break;
+  case 0xc7: case 0xcf: case 0xd7: case 0xdf:
+  case 0xe7: case 0xef: case 0xf7: case 0xff:
+    push(pc); pc = op & 0x38; break;
+  case 0xc6: case 0xce: case 0xd6: case 0xde:
+  case 0xe6: case 0xee: case 0xf6: case 0xfe:
+    alu((op >> 3) & 7, fetch()); break;
+  case 0xcb: n = exec_cb(); break;
+  case 0xe0: wr(0xff00 + fetch(), a); break;
+  case 0xf0: a = rd(0xff00 + fetch()); break;
+  case 0xe2: wr(0xff00 + c, a); break;
+  case 0xf2: a = rd(0xff00 + c); break;
+  case 0xea: wr(fetch16(), a); break;
+  case 0xfa: a = rd(fetch16()); break;
+  case 0xe8: case 0xf8:
+    v = fetch();
+    w = (sp + (signed char)v) & 0xffff;
+    f = (((sp & 0xf) + (v & 0xf)) > 0xf ? FH : 0) |
+        (((sp & 0xff) + v) > 0xff ? FC : 0);
+    if (op == 0xe8) sp = w; else set_hl(w);
+    break;
+  case 0xf9: sp = hl(); break;
+  case 0xf3: ime = 0; ime_pending = 0; break;
+  case 0xfb: ime_pending = 2; break;
+  default:
+    fprintf(stderr, "Invalid opcode 0x%02x at 0x%04x.\n", op, (pc - 1) & 0xffff);
+    crashed = 1;
+  }
+
+  return n;
+}
+
+/* Serve a pending interrupt, return the cycles it took (or 0). */
+int interrupt(void) {
+  unsigned char pending = ie & io[0x0f] & 0x1f;
+  int i;
+
+  if (pending) halted = 0;
+  if (!ime || !pending) return 0;
+
+  for (i = 0; !(pending & (1 << i)); ++i);
+  io[0x0f] &= ~(1 << i);
+  ime = 0;
+  push(pc);
+  pc = 0x40 + 8 * i;
+  return 20;
+}
+
+/* --- Measurements --- */
+
+int add_track(const char *name, int kind) {
+  struct track *t;
+
+  if (n_tracks == MAX_TRACK) {
+    fputs("Too many symbols.\n", stderr);
+    exit(2);
+  }
+  t = &tracks[n_tracks];
+  strncpy(t->name, name, sizeof(t->name) - 1);
+  t->kind = kind;
+  t->min = ~0ULL;
+  return n_tracks++;
+}
+
+void region_enter(int i) {
+  int r;
+
+  for (r = 0; r < n_regions; ++r) {
+    struct region *rg = &regions[r];
+    if (rg->from == i && !rg->started) {
+      rg->started = 1;
+      rg->start = cycles;
+    } else if (rg->to == i && rg->started && !rg->done) {
+      rg->done = 1;
+      rg->cycles = cycles - rg->start;
+    }
+  }
+}
+
+void track_enter(int i) {
+  struct track *t = &tracks[i];
+
+  if (t->kind == 'r') {
+    region_enter(i);
+  } else if (t->kind == 'f') {
+    if (depth == MAX_DEPTH) return;
+    stack[depth].t = i;
+    stack[depth].sp = sp;
+    stack[depth].start = cycles;
+    ++depth;
+  } else if (t->kind == 'i') {
+    /* Time between successive hits: one iteration of a loop. */
+    if (t->calls) {
+      unsigned long long dt = cycles - t->last, busy = dt - (idle_cycles - t->last_idle);
+      t->total += dt;
+      if (dt < t->min) t->min = dt;
+      if (dt > t->max) t->max = dt;
+      if (busy > t->busy_max) t->busy_max = busy;
+    }
+    t->last = cycles;
+    t->last_idle = idle_cycles;
+    ++t->calls;
+  }
+}
+
+/* After a return: close all calls whose return address was popped. */
+void track_return(void) {
+  while (depth && sp > stack[depth - 1].sp) {
+    struct frame *fr = &stack[--depth];
+    struct track *t = &tracks[fr->t];
+    unsigned long long dt = cycles - fr->start;
+
+    ++t->calls;
+    t->total += dt;
+    if (dt < t->min) t->min = dt;
+    if (dt > t->max) t->max = dt;
+  }
+}
+
+/* --- Symbols --- */
+
+/* Reads "DEF name 0xaddr" lines (.noi) or "  0000addr  name" lines (.map).
+ * A name given as a number (e.g. 0x0100, the entry point after the boot
+ * ROM) is used as the address directly. */
+void read_symbols(const char *path) {
+  FILE *in = fopen(path, "r");
+  char line[512], name[256];
+  unsigned long addr;
+  int i;
+
+  if (!in) {
+    fprintf(stderr, "Could not open %s.\n", path);
+    exit(2);
+  }
+
+  while (fgets(line, sizeof(line), in)) {
+    if (sscanf(line, "DEF %255s 0x%lx", name, &addr) != 2 &&
+        sscanf(line, " %lx %255s", &addr, name) != 2)
+      continue;
+
+    for (i = 0; i < n_tracks; ++i)
+      if (!strcmp(tracks[i].name, name) && !tracks[i].addr) tracks[i].addr = addr;
+  }
+  fclose(in);
+
+  for (i = 0; i < n_tracks; ++i) {
+    if (!tracks[i].addr && !strncmp(tracks[i].name, "0x", 2))
+      tracks[i].addr = strtoul(tracks[i].name, 0, 16);
+    if (!tracks[i].addr) {
+      fprintf(stderr, "Symbol %s not found in %s.\n", tracks[i].name, path);
+      exit(2);
+    }
+    track_at[tracks[i].addr & 0xffff] = 1;
+  }
+}
+
+/* --- Running --- */
+
+void reset(void) {
+  /* Register values left by the DMG boot ROM. */
+  a = 0x01; f = 0xb0; b = 0x00; c = 0x13; d = 0x00; e = 0xd8; h = 0x01; l = 0x4d;
+  sp = 0xfffe;
+  pc = 0x100;
+  io[0x00] = 0x30;
+  io[0x40] = 0x91;
+  io[0x47] = 0xfc;
+}
+
+/* Run for the given number of frames with the joypad in state buttons.
+ * Returns the busy (not halted) cycles per frame via busy/busy_max. */
+void run_frames(unsigned frames, unsigned char buttons,
+                unsigned long long *busy, unsigned long long *busy_max) {
+  unsigned long long end = cycles + (unsigned long long)frames * CYCLES_PER_FRAME;
+  unsigned long long frame_end = cycles + CYCLES_PER_FRAME, frame_idle = idle_cycles;
+  unsigned long long frame_start = cycles;
+
+  /* Newly pressed buttons raise the joypad interrupt. */
+  if (buttons & ~joy_state) io[0x0f] |= 0x10;
+  joy_state = buttons;
+
+  while (cycles < end && !crashed) {
+    int n = interrupt(), returned = 0;
+
+    if (!n) {
+      if (halted) {
+        n = 4;
+        idle_cycles += 4;
+      } else {
+        unsigned char op = rd(pc);
+
+        if (track_at[pc]) {
+          int t;
+          for (t = 0; t < n_tracks; ++t) {
+            unsigned long addr = tracks[t].addr;
+            if ((addr & 0xffff) == pc && (addr >> 16 == 0 || addr >> 16 == rom_bank))
+              track_enter(t);
+          }
+        }
+
+        if (ime_pending && !--ime_pending) ime = 1;
+        n = exec();
+        returned = op == 0xc9 || op == 0xd9 || ((op & 0xe7) == 0xc0 && n == 20);
+      }
+    }
+    tick(n);
+    if (returned) track_return();
+
+    if (cycles >= frame_end) {
+      unsigned long long fb = (cycles - frame_start) - (idle_cycles - frame_idle);
+      *busy += fb;
+      if (fb > *busy_max) *busy_max = fb;
+      frame_start = cycles;
+      frame_idle = idle_cycles;
+      frame_end += CYCLES_PER_FRAME;
+    }
+  }
+}
+
+/* --- Report and baseline --- */
+
+/* Keys compared against the baseline; all others are informational. */
+int is_cost_key(const char *key) {
+  static const char *keys[] = {
+    "max", "avg", "cycles", "busy", "busy_max", "vram_violations",
+    "oam_violations", 0
+  };
+  int i;
+  for (i = 0; keys[i]; ++i) if (!strcmp(key, keys[i])) return 1;
+  return 0;
+}
+
+#define MAX_REPORT 256
+char report[MAX_REPORT][256];
+int n_report;
+
+void out(const char *fmt, ...) {
+  va_list ap;
+
+  if (n_report == MAX_REPORT) return;
+  va_start(ap, fmt);
+  vsnprintf(report[n_report++], sizeof(report[0]), fmt, ap);
+  va_end(ap);
+}
+
+/* Compare every cost key of every line with the baseline line of the same
+ * kind and name and list the changes on stderr, savings included.
+ * Returns the number of regressions. */
+int compare(FILE *base, double tolerance) {
+  char line[256];
+  int i, bad = 0;
+
+  while (fgets(line, sizeof(line), base)) {
+    char kind[32], name[128];
+    int off;
+
+    if (sscanf(line, "%31s %127s %n", kind, name, &off) != 2 || kind[0] == '#') continue;
+
+    for (i = 0; i < n_report; ++i) {
+      char k2[32], n2[128];
+      int off2;
+
+      if (sscanf(report[i], "%31s %127s %n", k2, n2, &off2) != 2) continue;
+      if (strcmp(kind, k2) || strcmp(name, n2)) continue;
+
+      char *p = line + off;
+      char key[32];
+      unsigned long long old_v, new_v;
+      int used;
+
+      while (sscanf(p, "%31[^=]=%llu%n", key, &old_v, &used) == 2) {
+        p += used;
+        while (*p == ' ') ++p;
+        if (!is_cost_key(key)) continue;
+
+        char pat[40], *q;
+        snprintf(pat, sizeof(pat), " %s=", key);
+        if (!(q = strstr(report[i], pat))) continue;
+        new_v = strtoull(q + strlen(pat), 0, 10);
+
+        if (new_v == old_v) continue;
+        int regressed = new_v > old_v * (1 + tolerance / 100) + 0.5;
+        fprintf(stderr, "%s %s %s %s %llu -> %llu (%+lld)\n",
+                regressed ? "Regression:" : "Changed:   ", kind, name, key, old_v,
+                new_v, (long long)(new_v - old_v));
+        bad += regressed;
+      }
+    }
+  }
+
+  return bad;
+}
+
+void usage(void) {
+  fputs("Usage: gbbench [-s script] [-n frames] [-f func]... [-i func]...\n"
+        "               [-r from:to]... [-b baseline [-t percent] [-u]]\n"
+        "               cart.gb cart.noi\n"
+        "  -f  cycles per call of a function\n"
+        "  -i  cycles between successive calls (one loop iteration)\n"
+        "  -r  cycles from the first call of one function to the next\n"
+        "      call of another (e.g. _init:_main); addresses like 0x0100\n"
+        "      work in place of names\n"
+        "  -b  compare with a baseline report, fail if any cost grows by\n"
+        "      more than -t percent (default 0); -u writes it instead, a\n"
+        "      missing baseline is an error\n",
+        stderr);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *script = 0, *baseline = 0;
+  unsigned extra_frames = 60;
+  double tolerance = 0;
+  int update = 0, i;
+  FILE *in;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+    const char *opt = argv[i];
+
+    if (!strcmp(opt, "-u")) { update = 1; continue; }
+    if (i + 1 >= argc) usage();
+
+    const char *arg = argv[++i];
+    if (!strcmp(opt, "-s")) script = arg;
+    else if (!strcmp(opt, "-n")) extra_frames = atoi(arg);
+    else if (!strcmp(opt, "-b")) baseline = arg;
+    else if (!strcmp(opt, "-t")) tolerance = atof(arg);
+    else if (!strcmp(opt, "-f")) add_track(arg, 'f');
+    else if (!strcmp(opt, "-i")) add_track(arg, 'i');
+    else if (!strcmp(opt, "-r")) {
+      char from[64], to[64];
+      if (sscanf(arg, "%63[^:]:%63s", from, to) != 2 || n_regions == MAX_TRACK) usage();
+      regions[n_regions].from = add_track(from, 'r');
+      regions[n_regions].to = add_track(to, 'r');
+      ++n_regions;
+    } else usage();
+  }
+  if (argc - i != 2) usage();
+
+  if (!(in = fopen(argv[i], "rb"))) {
+    fprintf(stderr, "Could not open %s.\n", argv[i]);
+    return 2;
+  }
+  fseek(in, 0, SEEK_END);
+  rom_size = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  rom = malloc(rom_size);
+  if (!rom || fread(rom, 1, rom_size, in) != rom_size || rom_size < 0x8000) {
+    fprintf(stderr, "Could not read %s.\n", argv[i]);
+    return 2;
+  }
+  fclose(in);
+
+  read_symbols(argv[i + 1]);
+  /* One segment is kept free for the frames run after the script. */
+  if (script) read_script(script, segs, &n_segs, MAX_SEGS - 1);
+
+  /* Whatever the script does, run some frames after it. */
+  segs[n_segs].line = 0;
+  segs[n_segs].frames = extra_frames;
+  ++n_segs;
+
+  reset();
+  for (i = 0; i < n_segs && !crashed; ++i)
+    run_frames(segs[i].frames, segs[i].buttons, &seg_busy[i], &seg_busy_max[i]);
+
+  /* Report */
+  out("# kind name key=value... (cycles at 4.19 MHz, %d per frame)", CYCLES_PER_FRAME);
+  for (i = 0; i < n_tracks; ++i) {
+    struct track *t = &tracks[i];
+
+    if (t->kind == 'f') {
+      out("func %s calls=%lu min=%llu max=%llu avg=%llu frames_max=%.2f", t->name,
+          t->calls, t->calls ? t->min : 0, t->max, t->calls ? t->total / t->calls : 0,
+          (double)t->max / CYCLES_PER_FRAME);
+    } else if (t->kind == 'i') {
+      unsigned long n = t->calls > 1 ? t->calls - 1 : 0;
+      out("iter %s count=%lu min=%llu max=%llu avg=%llu busy_max=%llu", t->name, n,
+          n ? t->min : 0, t->max, n ? t->total / n : 0, t->busy_max);
+    }
+  }
+  for (i = 0; i < n_regions; ++i) {
+    struct region *rg = &regions[i];
+    out("region %s:%s reached=%d cycles=%llu frames=%.2f", tracks[rg->from].name,
+        tracks[rg->to].name, rg->done, rg->cycles, (double)rg->cycles / CYCLES_PER_FRAME);
+  }
+  for (i = 0; i < n_segs; ++i) {
+    out("seg %d frames=%u busy=%llu busy_max=%llu", segs[i].line, segs[i].frames,
+        seg_busy[i], seg_busy_max[i]);
+  }
+  out("total all frames=%llu cycles=%llu busy=%llu vram_violations=%lu "
+      "oam_violations=%lu", cycles / CYCLES_PER_FRAME, cycles, cycles - idle_cycles,
+      vram_violations, oam_violations);
+
+  for (i = 0; i < n_report; ++i) puts(report[i]);
+
+  if (crashed) return 2;
+
+  if (baseline) {
+    FILE *base = update ? 0 : fopen(baseline, "r");
+
+    if (base) {
+      int bad = compare(base, tolerance);
+      fclose(base);
+      return bad ? 1 : 0;
+    }
+    if (!update) {
+      fprintf(stderr, "Could not open baseline %s (write one with -u).\n", baseline);
+      return 2;
+    }
+
+    if (!(base = fopen(baseline, "w"))) {
+      fprintf(stderr, "Could not write %s.\n", baseline);
+      return 2;
+    }
+    for (i = 0; i < n_report; ++i) fprintf(base, "%s\n", report[i]);
+    fclose(base);
+    fprintf(stderr, "Wrote baseline %s.\n", baseline);
+  }
+
+  return 0;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Solves tic-tac-toe with minimax and writes the best move for every
+ * position as a C array for the cart.
+ *
+ * A position is indexed in base 3: cell (x,y) is digit y*3+x, with 0 = empty,
+ * 1 = player 1 ("X") and 2 = player 2 ("O"). The side to move follows from
+ * the stone counts (X always starts). Two moves are packed per byte, the
+ * lower nibble holding the even index. A move is the cell number 0..8;
+ * NO_MOVE marks unreachable or finished positions. */
+
+#define N_POS 19683 /* 3^9 */
+#define NO_MOVE 0xf
+
+const unsigned lines[8][3] = {
+  {0, 1, 2}, {3, 4, 5}, {6, 7, 8},
+  {0, 3, 6}, {1, 4, 7}, {2, 5, 8},
+  {0, 4, 8}, {2, 4, 6}
+};
+
+unsigned pow3[9];
+
+signed char score[N_POS];
+unsigned char solved[N_POS];
+unsigned char best[N_POS];
+unsigned char reachable[N_POS];
+
+void decode(unsigned idx, int cells[9]) {
+  int i;
+  for (i = 0; i < 9; ++i) {
+    cells[i] = idx % 3;
+    idx /= 3;
+  }
+}
+
+int winner(const int cells[9]) {
+  int i;
+  for (i = 0; i < 8; ++i) {
+    int c = cells[lines[i][0]];
+    if (c && c == cells[lines[i][1]] && c == cells[lines[i][2]]) return c;
+  }
+  return 0;
+}
+
+int to_move(const int cells[9]) {
+  int i, n = 0;
+  for (i = 0; i < 9; ++i) if (cells[i]) ++n;
+  return (n & 1) ? 2 : 1;
+}
+
+/* Score from the point of view of the side to move: positive is a win,
+ * faster wins (and slower losses) score higher. */
+int solve(unsigned idx) {
+  int cells[9], i, me, best_score = -100, best_move = NO_MOVE, moves = 0;
+
+  if (solved[idx]) return score[idx];
+
+  decode(idx, cells);
+  me = to_move(cells);
+
+  if (winner(cells)) {
+    /* The previous move won. */
+    best_score = -10;
+  } else {
+    for (i = 0; i < 9; ++i) {
+      if (cells[i]) continue;
+      int s = -solve(idx + pow3[i] * me);
+      if (s > 0) --s; else if (s < 0) ++s;
+      if (s > best_score) {
+        best_score = s;
+        best_move = i;
+      }
+      ++moves;
+    }
+    if (!moves) best_score = 0;
+  }
+
+  solved[idx] = 1;
+  score[idx] = best_score;
+  best[idx] = best_move;
+  return best_score;
+}
+
+void mark_reachable(unsigned idx) {
+  int cells[9], i, me;
+
+  if (reachable[idx]) return;
+  reachable[idx] = 1;
+
+  decode(idx, cells);
+  if (winner(cells)) return;
+  me = to_move(cells);
+
+  for (i = 0; i < 9; ++i)
+    if (!cells[i]) mark_reachable(idx + pow3[i] * me);
+}
+
+void write_moves(FILE *out, const char *name) {
+  int i, n = (N_POS + 1) / 2, n_reach = 0;
+
+  for (i = 0; i < N_POS; ++i) if (reachable[i]) ++n_reach;
+
+  fprintf(out, "/* %d reachable positions, move = cell y*3+x, 0x%x = none */\n",
+          n_reach, NO_MOVE);
+  fprintf(out, "const unsigned char %s[%d] = {\n", name, n);
+
+  for (i = 0; i < n; ++i) {
+    unsigned lo = 2*i, hi = 2*i + 1;
+    unsigned m_lo = reachable[lo] ? best[lo] : NO_MOVE,
+             m_hi = (hi < N_POS && reachable[hi]) ? best[hi] : NO_MOVE;
+
+    if (i % 16 == 0) fputs("  ", out);
+    fprintf(out, "0x%02x", (m_hi << 4) | m_lo);
+    if (i != n - 1) fputc(',', out);
+    if (i % 16 == 15 || i == n - 1) fputc('\n', out); else fputc(' ', out);
+  }
+
+  fputs("};\n", out);
+}
+
+int main(int argc, char **argv) {
+  int i;
+
+  for (i = 0, pow3[0] = 1; i < 8; ++i) pow3[i + 1] = pow3[i] * 3;
+
+  solve(0);
+  mark_reachable(0);
+
+  FILE *f_out = argc > 1 ? fopen(argv[1], "w") : stdout;
+
+  if (!f_out) {
+    fputs("Could not open output file.\n", stderr);
+    return 1;
+  }
+
+  write_moves(f_out, argc > 2 ? argv[2] : "ai_moves");
+  fclose(f_out);
+
+  return 0;
+}
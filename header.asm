@@ -1,5 +1,17 @@
 .area _IVT
+  ; RST vectors 0x00-0x38 (unused)
+  .ds 0x40
 
+  ; Interrupt vectors, 8 bytes each
+  jp vblank_irq       ; 0x40 VBlank
+  .ds 5
+  reti                ; 0x48 LCD STAT
+  .ds 7
+  reti                ; 0x50 Timer
+  .ds 7
+  reti                ; 0x58 Serial
+  .ds 7
+  reti                ; 0x60 Joypad
 
 .area _HEADER
   nop
@@ -38,4 +50,91 @@ entry:
   ei
   jp _init
 
+; Save all registers around the C handler, which may clobber any of them.
+.globl _vblank_isr
+vblank_irq:
+  push af
+  push bc
+  push de
+  push hl
+  call _oam_dma
+  call _vblank_isr
+  pop hl
+  pop de
+  pop bc
+  pop af
+  reti
+
+; Move the shadow OAM to OAM. The CPU can only access HRAM while the DMA
+; is running, so the routine is copied there (oam_dma_hram, see _HRAM
+; below) by _init_oam_dma.
+_init_oam_dma::
+  ld hl, #oam_dma_hram
+  ld de, #oam_dma_rom
+  ld b, #(oam_dma_rom_end - oam_dma_rom)
+1$:
+  ld a, (de)
+  inc de
+  ld (hl+), a
+  dec b
+  jr nz, 1$
+  ret
+
+; Only call during VBlank (or with the LCD off).
+_oam_dma::
+  ld a, #>_shadow_oam
+  jp oam_dma_hram
+
+oam_dma_rom:
+  ldh (0x46), a       ; start DMA from a * 0x100
+  ld a, #40           ; wait 160 cycles
+1$:
+  dec a
+  jr nz, 1$
+  ret
+oam_dma_rom_end:
+
+; Shadow copy of the sprite attribute table (40 sprites * 4 bytes).
+; OAM DMA needs a page-aligned source, so this area is placed at the
+; start of WRAM (see GBLDFLAGS).
+.area _SHADOW_OAM
+_shadow_oam::
+  .ds 160
+
+; High RAM, 0xff80-0xfffe (see GBLDFLAGS). It holds the OAM DMA routine
+; and the state used every frame, which cart.c declares as __sfr so that
+; it is accessed with ldh. Like WRAM it is not cleared at power-on.
+; The interrupt handlers stay in ROM: code runs no faster from HRAM.
+.area _HRAM
+oam_dma_hram:
+  .ds oam_dma_rom_end - oam_dma_rom
+_frame_count::
+  .ds 1
+_vq_head::
+  .ds 1
+_vq_tail::
+  .ds 1
+_blit_rows::
+  .ds 1
+_bg_flip_pending::
+  .ds 1
+_scroll_x::
+  .ds 1
+_scroll_y::
+  .ds 1
+_char_pos_x::
+  .ds 1
+_char_pos_y::
+  .ds 1
+_joy_state::
+  .ds 1
+_joy_pressed::
+  .ds 1
+_joy_released::
+  .ds 1
+_joy_head::
+  .ds 1
+_joy_tail::
+  .ds 1
+
 .area _DATA
@@ -0,0 +1,387 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cart.h"
+#include "script.h"
+
+/* Runs the game logic of cart.c natively (make host).
+ *
+ * cart.c is compiled with -DHOST: its register and VRAM pointers then
+ * point into host_mem (see host.h), the assembler routines are replaced
+ * by C versions and halt_cpu() ends up in host_halt() below, which plays
+ * the part of the LCD controller and the interrupts - one call is one
+ * frame. Nothing here is cycle accurate; use gbbench for that. What the
+ * host build is good for is checking and timing the logic quickly:
+ *
+ *   cart_host -t             exhaustive checks of the board logic, the
+ *                            move table and the math helpers, with the
+ *                            number of set_stone() calls per second
+ *   cart_host -s script      plays a gbbench input script (see bench.inp)
+ *                            and prints the screen it ends on
+ *
+ * Returns 0 on success, 1 if a check failed and 2 on usage errors. */
+
+#define MAX_SEGS 1024
+
+unsigned char host_mem[0x10000];
+
+/* The variables header.asm keeps in HRAM */
+volatile unsigned char frame_count, vq_head, vq_tail, blit_rows;
+volatile unsigned char bg_flip_pending;
+unsigned char scroll_x, scroll_y, char_pos_x, char_pos_y;
+volatile unsigned char joy_state, joy_pressed, joy_released;
+volatile unsigned char joy_head, joy_tail;
+
+enum { IRQ_VBLANK = 0x01, IRQ_JOYPAD = 0x10 };
+
+int failures;
+
+void fail(const char *fmt, ...) {
+  va_list ap;
+
+  if (failures++ < 10) {
+    va_start(ap, fmt);
+    fputs("FAIL: ", stderr);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+  }
+}
+
+double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* --- Hardware --- */
+
+unsigned char pad;  /* buttons held, J_* bits */
+
+unsigned char *host_hw(unsigned int a) {
+  if (a == 0xff00) {
+    /* Active low; a group is read while its select bit is 0. */
+    unsigned char v = host_mem[0xff00] | 0xcf;
+    if (!(v & 0x10)) v &= ~(pad & 0x0f);
+    if (!(v & 0x20)) v &= ~(pad >> 4);
+    host_mem[0xff00] = v;
+  }
+  return host_mem + a;
+}
+
+/* The OAM DMA routine of header.asm */
+void init_oam_dma(void) {}
+
+void oam_dma(void) {
+  memcpy(host_mem + 0xfe00, shadow_oam, sizeof(sprite_t) * 40);
+}
+
+/* --- Input script --- */
+
+struct script_seg segs[MAX_SEGS];
+int n_segs, cur_seg;
+unsigned seg_left, extra_frames = 60, n_frames;
+double start_time;
+
+/* The visible 20x18 tiles, shown by name: the background map LCDC
+ * selects, scrolled, with the window over it if it is on. */
+void print_screen(void) {
+  char names[256];
+  unsigned char lcdc = host_mem[0xff40];
+  const unsigned char *bg = host_mem + (lcdc & 0x08 ? 0x9c00 : 0x9800);
+  const unsigned char *win = host_mem + (lcdc & 0x40 ? 0x9c00 : 0x9800);
+  unsigned sx = host_mem[0xff43] >> 3, sy = host_mem[0xff42] >> 3;
+  unsigned wx = (host_mem[0xff4b] - 7) >> 3, wy = host_mem[0xff4a] >> 3;
+  unsigned x, y;
+  int c;
+
+  memset(names, '?', sizeof(names));
+  for (c = 126; c >= 32; --c) names[tiles_map[c]] = c;
+  names[0] = ' ';
+
+  for (y = 0; y < 18; ++y) {
+    putchar('|');
+    for (x = 0; x < 20; ++x) {
+      if ((lcdc & 0x20) && x >= wx && y >= wy)
+        putchar(names[win[(y - wy) * 32 + x - wx]]);
+      else
+        putchar(names[bg[((sy + y) & 31) * 32 + ((sx + x) & 31)]]);
+    }
+    puts("|");
+  }
+}
+
+void finish(void) {
+  double t = now_sec() - start_time;
+
+  print_screen();
+  printf("host frames=%u time_ms=%.1f frames_per_s=%.0f\n",
+         n_frames, t * 1e3, t > 0 ? n_frames / t : 0);
+  exit(0);
+}
+
+/* One frame: the next scripted joypad state, then the VBlank. */
+void next_frame(void) {
+  while (!seg_left) {
+    if (cur_seg < n_segs) {
+      seg_left = segs[cur_seg].frames;
+      pad = segs[cur_seg++].buttons;
+    } else if (extra_frames) {
+      seg_left = extra_frames;
+      extra_frames = 0;
+      pad = 0;
+    } else {
+      finish();
+    }
+  }
+  --seg_left;
+  ++n_frames;
+}
+
+void host_halt(void) {
+  unsigned char old = pad;
+
+  for (;;) {
+    next_frame();
+    if (host_mem[0xffff] & IRQ_VBLANK) {
+      oam_dma();
+      vblank_isr();
+      return;
+    }
+    /* Only the joypad interrupt: sleep until a button goes down. */
+    if ((host_mem[0xffff] & IRQ_JOYPAD) && (pad & ~old)) return;
+    old = pad;
+  }
+}
+
+/* --- Self-test --- */
+
+const unsigned lines[8][3] = {
+  {0, 1, 2}, {3, 4, 5}, {6, 7, 8},
+  {0, 3, 6}, {1, 4, 7}, {2, 5, 8},
+  {0, 4, 8}, {2, 4, 6}
+};
+
+int ref_wins(unsigned mask) {
+  int i;
+  for (i = 0; i < 8; ++i)
+    if ((mask >> lines[i][0] & 1) && (mask >> lines[i][1] & 1) &&
+        (mask >> lines[i][2] & 1)) return 1;
+  return 0;
+}
+
+unsigned ref_index(void) {
+  unsigned idx = 0, p = 1;
+  int i;
+  for (i = 0; i < 9; ++i, p *= 3)
+    idx += p * ((stones[0] >> i & 1) + 2 * (stones[1] >> i & 1));
+  return idx;
+}
+
+void test_math(void) {
+  unsigned a, b;
+  unsigned char r;
+
+  for (a = 0; a < 256; ++a) {
+    for (b = 0; b < 256; ++b) {
+      if (mul8(a, b) != a * b) fail("mul8(%d, %d) = %d", a, b, mul8(a, b));
+      if (!b) continue;
+      if (divmod8(a, b, &r) != a / b || r != a % b)
+        fail("divmod8(%d, %d) = %d", a, b, divmod8(a, b, &r));
+    }
+    if (pixel_to_cell[a] != (a < 84 ? a / 28 : 0xff))
+      fail("pixel_to_cell[%d] = %d", a, pixel_to_cell[a]);
+  }
+}
+
+unsigned long moves, games, results[3];
+
+/* ai: the side that plays from the move table (0 = nobody). Every other
+ * move is tried in turn, so this walks all games against the table. */
+void play(int player, int ai);
+
+void try_move(int player, int x, int y, int ai) {
+  unsigned s0 = stones[0], s1 = stones[1], pi = pos_index;
+  int w;
+
+  set_stone(player, x, y);
+  ++moves;
+
+  w = ref_wins(stones[player - 1]) ? player : 0;
+  if (check_win() != w) fail("winner %d, expected %d (stones %03x)",
+                             check_win(), w, stones[0] | stones[1] << 9);
+  if (full() != ((stones[0] | stones[1]) == 0x1ff))
+    fail("full() = %d for %03x %03x", full(), stones[0], stones[1]);
+  if (pos_index != ref_index())
+    fail("pos_index %d, expected %d", pos_index, ref_index());
+
+  if (w || full()) {
+    ++games;
+    ++results[w];
+  } else {
+    play(3 - player, ai);
+  }
+
+  stones[0] = s0;
+  stones[1] = s1;
+  pos_index = pi;
+  winner = board_full = 0;
+}
+
+void play(int player, int ai) {
+  int x, y;
+
+  if (player == ai) {
+    unsigned char m = ai_move();
+    if (m > 8 || !field_free(cell_x[m], cell_y[m])) {
+      fail("ai_move() = %d at index %d", m, pos_index);
+      return;
+    }
+    try_move(player, cell_x[m], cell_y[m], ai);
+    return;
+  }
+
+  for (y = 0; y < 3; ++y)
+    for (x = 0; x < 3; ++x)
+      if (field_free(x, y)) try_move(player, x, y, ai);
+}
+
+/* m,n,k: random games, the incremental check against a full scan of
+ * all lines after every move */
+int ref_mnk_winner(void) {
+  static const int dx[4] = { 1, 0, 1, 1 }, dy[4] = { 0, 1, 1, -1 };
+  int x, y, d, i, p;
+
+  for (y = 0; y < board_n; ++y)
+    for (x = 0; x < board_m; ++x) {
+      if (!(p = mnk_board[y][x])) continue;
+      for (d = 0; d < 4; ++d) {
+        for (i = 1; i < board_k; ++i) {
+          int xi = x + i * dx[d], yi = y + i * dy[d];
+          if (xi < 0 || yi < 0 || xi >= board_m || yi >= board_n ||
+              mnk_board[yi][xi] != p) break;
+        }
+        if (i == board_k) return p;
+      }
+    }
+  return 0;
+}
+
+unsigned long rnd_state = 1;
+
+unsigned rnd(unsigned n) {
+  rnd_state = rnd_state * 1103515245 + 12345;
+  return (rnd_state >> 16) % n;
+}
+
+void test_mnk(unsigned char mode, int n_games) {
+  unsigned char free_x[225], free_y[225];
+  unsigned long n_moves = 0, wins = 0;
+  int g, n, i, player, x, y;
+
+  set_game_mode(mode);
+  for (g = 0; g < n_games; ++g) {
+    mnk_clear_field();
+    for (n = 0, y = 0; y < board_n; ++y)
+      for (x = 0; x < board_m; ++x, ++n) {
+        free_x[n] = x;
+        free_y[n] = y;
+      }
+
+    for (player = 1; n; player = 3 - player) {
+      i = rnd(n);
+      mnk_set_stone(player, free_x[i], free_y[i]);
+      free_x[i] = free_x[--n];
+      free_y[i] = free_y[n];
+      ++n_moves;
+
+      if (check_win() != ref_mnk_winner())
+        fail("%dx%d,%d game %d: winner %d, expected %d", board_m, board_n,
+             board_k, g, check_win(), ref_mnk_winner());
+      if (full() != !n)
+        fail("%dx%d,%d game %d: full() = %d", board_m, board_n, board_k,
+             g, full());
+      if (check_win()) {
+        ++wins;
+        break;
+      }
+    }
+  }
+  printf("mnk %dx%d k=%d games=%d won=%lu moves=%lu\n", board_m, board_n,
+         board_k, n_games, wins, n_moves);
+  set_game_mode(0);
+}
+
+void run_all(int ai) {
+  moves = games = results[0] = results[1] = results[2] = 0;
+  clear_field();
+  play(1, ai);
+}
+
+int self_test(void) {
+  double t;
+  int i, ai, runs = 20;
+
+  test_math();
+
+  /* All games: 255168 in total, 131184 won by X, 77904 by O, 46080 drawn */
+  run_all(0);
+  printf("games total=%lu x=%lu o=%lu draw=%lu\n",
+         games, results[1], results[2], results[0]);
+  if (games != 255168 || results[1] != 131184 || results[2] != 77904 ||
+      results[0] != 46080) fail("wrong game count");
+
+  /* The move table never loses, whichever side it plays */
+  for (ai = 1; ai <= 2; ++ai) {
+    run_all(ai);
+    printf("table as %c games=%lu lost=%lu draw=%lu\n", ai == 1 ? 'X' : 'O',
+           games, results[3 - ai], results[0]);
+    if (results[3 - ai]) fail("table as player %d lost %d games",
+                              ai, (int)results[3 - ai]);
+  }
+
+  for (i = 1; i < 3; ++i) test_mnk(i, 500);
+
+  t = now_sec();
+  for (i = 0; i < runs; ++i) run_all(0);
+  t = now_sec() - t;
+  printf("logic moves=%lu time_ms=%.1f moves_per_s=%.0f\n",
+         moves * runs, t * 1e3, t > 0 ? moves * runs / t : 0);
+
+  if (failures) {
+    fprintf(stderr, "%d check(s) failed.\n", failures);
+    return 1;
+  }
+  puts("all checks passed");
+  return 0;
+}
+
+void usage(void) {
+  fputs("Usage: cart_host -t\n"
+        "       cart_host -s script [-n frames]\n", stderr);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *script = 0;
+  int i, test = 0;
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-t")) test = 1;
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc) script = argv[++i];
+    else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      extra_frames = atoi(argv[++i]);
+    else usage();
+  }
+
+  if (test) return self_test();
+  if (!script) usage();
+
+  read_script(script, segs, &n_segs, MAX_SEGS);
+  start_time = now_sec();
+  init();  /* runs the game; finish() exits when the script is over */
+  return 0;
+}
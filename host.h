@@ -0,0 +1,18 @@
+/* Included by cart.c when it is compiled with -DHOST for the PC
+ * (make host), see host.c. */
+
+/* The Game Boy address space: registers, VRAM, OAM and HRAM. */
+extern unsigned char host_mem[0x10000];
+
+/* Address a -> pointer into host_mem; reading the joypad register
+ * updates its input bits from the scripted buttons first. */
+unsigned char *host_hw(unsigned int a);
+#define HW(a) host_hw(a)
+#define HW_ADDR(p) ((unsigned int)((unsigned char *)(p) - host_mem))
+
+/* Runs frames until the next interrupt the cart has enabled. */
+void host_halt(void);
+
+/* sdcc keywords; the HRAM variables are plain globals in host.c */
+#define __sfr unsigned char
+#define __naked
@@ -1,80 +1,286 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#define BUF_SIZE 0x10000
-#define WR_SIZE 0x8000
+/* Up to 512 banks of 16 KiB (MBC5). */
+#define BUF_SIZE 0x800000
+#define BANK_SIZE 0x4000
+#define MIN_SIZE 0x8000UL
 
-char buf[BUF_SIZE];
-unsigned buf_pos = 0, max_buf_pos = 0;
+/* Cartridge header fields patched to match the image. */
+#define HDR_CART_TYPE 0x147
+#define HDR_ROM_SIZE 0x148
+#define HDR_CHECKSUM 0x14d
+#define HDR_GLOBAL_CHECKSUM 0x14e
 
-unsigned read_hex_digit(FILE *in) {
-  char c = fgetc(in);
-  if (c <= '9' && c >= '0') return c - '0';
-  if (c <= 'f' && c >= 'a') return c - 'a' + 10;
-  if (c <= 'F' && c >= 'A') return c - 'A' + 10;
+#define CART_ROM_ONLY 0x00
+#define CART_MBC1 0x01
+#define CART_MBC5 0x19
 
-  printf("'%c' not a hex digit.\n", c);
-  exit(1);
-}
+unsigned char buf[BUF_SIZE];
+unsigned long buf_pos = 0, max_buf_pos = 0;
+
+/* Upper address bits from extended segment (02) or linear (04) records. */
+unsigned long addr_base = 0;
+
+/* Whole input file, read at once. */
+unsigned char *in_data;
+size_t in_len;
 
-unsigned read_hex_byte(FILE *in) {
-  unsigned hi = read_hex_digit(in),
-           lo = read_hex_digit(in);
+/* Hex digit value, or 0xff for anything else. */
+unsigned char hex_val[256];
 
-  return (hi << 4) | lo;
+void init_hex_val(void) {
+  int i;
+
+  memset(hex_val, 0xff, sizeof(hex_val));
+  for (i = 0; i < 10; ++i) hex_val['0' + i] = i;
+  for (i = 0; i < 6; ++i) hex_val['a' + i] = hex_val['A' + i] = 10 + i;
 }
 
-unsigned read_hex_word(FILE *in) {
-  unsigned hi = read_hex_byte(in),
-           lo = read_hex_byte(in);
+int read_input(FILE *in) {
+  size_t cap = 1 << 20, n;
+
+  in_data = malloc(cap);
+  in_len = 0;
+
+  while (in_data && (n = fread(in_data + in_len, 1, cap - in_len, in)) > 0) {
+    in_len += n;
+    if (in_len == cap) in_data = realloc(in_data, cap *= 2);
+  }
+
+  return in_data && !ferror(in);
+}
 
-  return (hi << 8) | lo;
+void parse_error(unsigned line, const char *msg) {
+  fprintf(stderr, "Line %u: %s\n", line, msg);
+  exit(1);
 }
 
-unsigned read_ihx_line(FILE* in) {
-  char newline, colon = fgetc(in);
-  if (colon != ':') { puts("Expected ':'"); exit(1); }
+/* Map a linker address to an offset in the ROM image. Bank 0 and 1 are
+ * at 0x0000-0x7fff as usual; sdldgb puts bank n > 1 at n << 16 | 0x4000-
+ * 0x7fff. */
+unsigned long rom_offset(unsigned long addr) {
+  unsigned long bank = addr >> 16, local = addr & 0xffff;
 
-  unsigned size = read_hex_byte(in);
-  buf_pos = read_hex_word(in);
+  if (bank == 0 && local < 0x8000) return local;
 
-  if (size == 0) return 0;
+  if (local < 0x4000 || local >= 0x8000) {
+    fprintf(stderr, "Address 0x%06lx is not in switchable ROM.\n", addr);
+    exit(1);
+  }
 
-  unsigned rtype = read_hex_byte(in);
+  return bank * BANK_SIZE + local - 0x4000;
+}
 
+/* Apply one record. Returns 0 at the end-of-file record. */
+unsigned handle_record(unsigned rtype, unsigned addr, const unsigned char *data,
+                       unsigned size, unsigned line) {
   unsigned i;
-  for (i = 0; i < size; ++i) {
-    buf[buf_pos++] = read_hex_byte(in);
+
+  switch (rtype) {
+  case 0x00: /* data */
+    buf_pos = rom_offset(addr_base + addr);
+    if (buf_pos + size > BUF_SIZE) parse_error(line, "Image too large.");
+    for (i = 0; i < size; ++i) buf[buf_pos++] = data[i];
     if (buf_pos > max_buf_pos) max_buf_pos = buf_pos;
+    return 1;
+  case 0x01: /* end of file */
+    return 0;
+  case 0x02: /* extended segment address */
+    if (size != 2) parse_error(line, "Bad address record.");
+    addr_base = (unsigned long)((data[0] << 8) | data[1]) << 4;
+    return 1;
+  case 0x04: /* extended linear address */
+    if (size != 2) parse_error(line, "Bad address record.");
+    addr_base = (unsigned long)((data[0] << 8) | data[1]) << 16;
+    return 1;
+  case 0x03: /* start segment address */
+  case 0x05: /* start linear address */
+    return 1;
   }
 
-  unsigned checksum = read_hex_byte(in);
+  parse_error(line, "Unknown record type.");
+  return 0;
+}
 
-  newline = fgetc(in);
-  if (newline != '\n') { puts("Expected newline."); exit(1); }
+/* Parse all records in in_data. Every record is ":" followed by hex
+ * pairs (count, address hi/lo, type, data, checksum) and LF or CRLF; the
+ * bytes of a record including the checksum must add up to 0. */
+void parse_ihx(void) {
+  const unsigned char *p = in_data, *end = in_data + in_len;
+  unsigned char rec[5 + 255];
+  unsigned line = 1;
 
+  while (p < end) {
+    unsigned i, n, sum = 0;
+
+    /* Tolerate empty lines (e.g. at the end of the file). */
+    if (*p == '\n') { ++p; ++line; continue; }
+    if (*p == '\r' && p + 1 < end && p[1] == '\n') { p += 2; ++line; continue; }
+
+    if (*p++ != ':') parse_error(line, "Expected ':'.");
+
+    /* Count first, then the rest of the record. */
+    for (i = 0, n = 1; i < n; ++i, p += 2) {
+      unsigned char hi, lo;
+
+      if (end - p < 2) parse_error(line, "Truncated record.");
+      hi = hex_val[p[0]];
+      lo = hex_val[p[1]];
+      if ((hi | lo) & 0xf0) parse_error(line, "Not a hex digit.");
+
+      rec[i] = (hi << 4) | lo;
+      sum += rec[i];
+      if (i == 0) n = 5 + rec[0];
+    }
+
+    if (sum & 0xff) parse_error(line, "Checksum mismatch.");
+
+    if (p < end && *p == '\r') ++p;
+    if (p < end && *p++ != '\n') parse_error(line, "Expected newline.");
+
+    if (!handle_record(rec[3], (rec[1] << 8) | rec[2], rec + 4, rec[0], line))
+      return;
+    ++line;
+  }
+}
+
+/* Smallest valid ROM size (32 KiB << n) holding the image. */
+unsigned long rom_size(void) {
+  unsigned long size = MIN_SIZE;
+  while (size < max_buf_pos) size <<= 1;
   return size;
 }
 
-void mk_gb_checksums(void) {
-  unsigned i, y = 0;
+/* Header ROM size code for an image size. */
+unsigned char rom_size_code(unsigned long size) {
+  unsigned char code = 0;
+  while ((MIN_SIZE << code) < size) ++code;
+  return code;
+}
+
+/* ROM size and, for banked images, MBC type in the header. */
+void patch_header(unsigned long size, unsigned char mbc) {
+  unsigned char code = rom_size_code(size);
+
+  buf[HDR_ROM_SIZE] = code;
+  if (size > MIN_SIZE && buf[HDR_CART_TYPE] == CART_ROM_ONLY)
+    buf[HDR_CART_TYPE] = mbc;
+}
+
+/* Checksum over the header bytes 0x134-0x14c. */
+unsigned char header_checksum(void) {
+  unsigned i;
   unsigned char x = 0;
-  for (i = 0x134; i < 0x14d; i++) x = x - buf[i] - 1;
-  buf[0x14d] = x;
+  for (i = 0x134; i < HDR_CHECKSUM; i++) x = x - buf[i] - 1;
+  return x;
+}
+
+/* Sum of all bytes of the image except the global checksum itself. */
+unsigned global_checksum(unsigned long size) {
+  unsigned long i;
+  unsigned y = 0;
+  for (i = 0; i < size; i++) y += buf[i];
+  y -= buf[HDR_GLOBAL_CHECKSUM] + buf[HDR_GLOBAL_CHECKSUM + 1];
+  return y & 0xffff;
+}
+
+void mk_gb_checksums(unsigned long size) {
+  unsigned y;
 
-  for (i = 0; i < WR_SIZE; i++) if (i != 0x14e && i != 0x14f) y += buf[i];
-  // buf[0x14e] = (y >> 8) & 0xff;
-  // buf[0x14f] = y & 0xff;
+  buf[HDR_CHECKSUM] = header_checksum();
+
+  /* Includes the header checksum, so it must be computed last. */
+  y = global_checksum(size);
+  buf[HDR_GLOBAL_CHECKSUM] = (y >> 8) & 0xff;
+  buf[HDR_GLOBAL_CHECKSUM + 1] = y & 0xff;
+}
+
+/* Check an existing image without rewriting it. */
+int verify(const char *path) {
+  FILE *f = fopen(path, "rb");
+  unsigned long size;
+  unsigned y, y_hdr;
+  int ok = 1;
+
+  if (!f) {
+    fprintf(stderr, "Could not open %s.\n", path);
+    return 1;
+  }
+  size = fread(buf, 1, BUF_SIZE, f);
+  fclose(f);
+
+  if (size < MIN_SIZE || (size & (size - 1))) {
+    fprintf(stderr, "%s: size %lu is not a valid ROM size.\n", path, size);
+    return 1;
+  }
+
+  if (buf[HDR_ROM_SIZE] != rom_size_code(size)) {
+    fprintf(stderr, "%s: ROM size byte 0x%02x, expected 0x%02x.\n", path,
+            buf[HDR_ROM_SIZE], rom_size_code(size));
+    ok = 0;
+  }
+
+  if (buf[HDR_CHECKSUM] != header_checksum()) {
+    fprintf(stderr, "%s: header checksum 0x%02x, expected 0x%02x.\n", path,
+            buf[HDR_CHECKSUM], header_checksum());
+    ok = 0;
+  }
+
+  y = global_checksum(size);
+  y_hdr = (buf[HDR_GLOBAL_CHECKSUM] << 8) | buf[HDR_GLOBAL_CHECKSUM + 1];
+  if (y != y_hdr) {
+    fprintf(stderr, "%s: global checksum 0x%04x, expected 0x%04x.\n", path,
+            y_hdr, y);
+    ok = 0;
+  }
+
+  if (ok) fprintf(stderr, "%s: OK\n", path);
+  return !ok;
 }
 
 int main(int argc, char** argv) {
-  unsigned i;
+  /* MBC used if the image does not fit a 32 KiB ROM-only cartridge. */
+  unsigned char mbc = CART_MBC1;
+  unsigned long size;
+
+  if (argc > 2 && !strcmp(argv[1], "--verify")) return verify(argv[2]);
+
+  if (argc > 1 && !strcmp(argv[1], "-mbc5")) mbc = CART_MBC5;
+  else if (argc > 1 && strcmp(argv[1], "-mbc1")) {
+    fputs("Usage: ihx_to_bin [-mbc1|-mbc5] < in.ihx > out.gb\n"
+          "       ihx_to_bin --verify file.gb\n", stderr);
+    return 1;
+  }
 
   memset(buf, 0, BUF_SIZE);
-  while (read_ihx_line(stdin));
-  mk_gb_checksums();
-  fwrite(buf, sizeof(buf[0]), WR_SIZE, stdout);
+  init_hex_val();
+
+  if (!read_input(stdin)) {
+    fputs("Could not read input.\n", stderr);
+    return 1;
+  }
+
+  clock_t t = clock();
+  parse_ihx();
+  double secs = (double)(clock() - t) / CLOCKS_PER_SEC;
+
+  fprintf(stderr, "parsed %lu bytes of hex in %.3f ms", (unsigned long)in_len,
+          secs * 1e3);
+  if (secs > 0) fprintf(stderr, " (%.1f MB/s)", in_len / secs / 1e6);
+  fputc('\n', stderr);
+
+  size = rom_size();
+  if (mbc == CART_MBC1 && size > 0x200000) {
+    fputs("Image too large for MBC1, use -mbc5.\n", stderr);
+    return 1;
+  }
+
+  patch_header(size, mbc);
+  mk_gb_checksums(size);
+  fwrite(buf, sizeof(buf[0]), size, stdout);
   
   return 0;
 }
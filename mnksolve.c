@@ -0,0 +1,620 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Solves m,n,k games (m x n board, k in a row wins) on the host: an
+ * opening book for the cart and a check for genai's table.
+ *
+ * Every position of the book (all positions with fewer than -d stones,
+ * reachable from the empty board) is a task: its moves are solved
+ * exactly with alpha-beta, then its successors are queued as new tasks.
+ * Each thread keeps its own task deque, taking from the back; an idle
+ * thread steals from the front of another thread's deque. All threads
+ * share one transposition table without locks: an entry is two 64-bit
+ * words, the key XOR the data and the data, so a torn read simply does
+ * not match. Positions are keyed by the smallest of their Zobrist hashes
+ * under the board symmetries (8 on square boards, 4 otherwise), which
+ * folds mirrored and rotated positions into one entry.
+ *
+ * Scores are those of genai.c, from the side to move: a win scores
+ * cells + 1 minus the number of moves to it, a loss the negative, a
+ * draw 0. With -o the best move for every book position is written in
+ * genai's format (base-3 index, two moves per byte), which needs a board
+ * of at most 15 cells; for 3x3 the output is identical to ai.inc.
+ *
+ * The report is "kind name key=value ..." lines as in gbbench; -S repeats
+ * the run with 1, 2, 4, ... threads to show the scaling. */
+
+#define MAX_CELLS 64
+#define MAX_K 16
+#define MAX_THREADS 64
+#define MAX_TABLE_CELLS 15
+#define NO_MOVE 0xf
+#define INF 100
+#define OCCUPIED (-128)
+
+enum { EXACT, LOWER, UPPER };
+
+int m = 3, n = 3, k = 3, cells, win_score, n_syms, depth_limit;
+
+/* sym[s][c]: where cell c goes under symmetry s */
+unsigned char sym[8][MAX_CELLS];
+uint64_t zobrist[MAX_CELLS][2];
+
+/* All k-cell lines through a cell, as bit masks */
+uint64_t lines[MAX_CELLS][4 * MAX_K];
+int n_lines[MAX_CELLS];
+
+/* Search order: cells closest to the center first */
+unsigned char order[MAX_CELLS];
+
+typedef struct {
+  uint64_t stones[2];   /* X, O */
+  uint64_t hash[8];     /* one Zobrist hash per symmetry */
+  int count;            /* stones on the board, X moves when even */
+} board_t;
+
+/* --- Board --- */
+
+uint64_t splitmix(uint64_t *s) {
+  uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void setup(void) {
+  static const int dx[4] = { 1, 0, 1, 1 }, dy[4] = { 0, 1, 1, -1 };
+  uint64_t seed = 1;
+  int x, y, c, d, i, s, dist[MAX_CELLS];
+
+  cells = m * n;
+  win_score = cells + 1;
+  n_syms = m == n ? 8 : 4;
+
+  for (y = 0; y < n; ++y)
+    for (x = 0; x < m; ++x) {
+      c = y * m + x;
+      sym[0][c] = c;
+      sym[1][c] = y * m + (m - 1 - x);
+      sym[2][c] = (n - 1 - y) * m + x;
+      sym[3][c] = (n - 1 - y) * m + (m - 1 - x);
+      if (m == n) {
+        sym[4][c] = x * m + y;
+        sym[5][c] = x * m + (m - 1 - y);
+        sym[6][c] = (m - 1 - x) * m + y;
+        sym[7][c] = (m - 1 - x) * m + (m - 1 - y);
+      }
+      zobrist[c][0] = splitmix(&seed);
+      zobrist[c][1] = splitmix(&seed);
+      /* Twice the distance to the center, squared, so it stays integral */
+      dist[c] = (2 * x - m + 1) * (2 * x - m + 1) + (2 * y - n + 1) * (2 * y - n + 1);
+      order[c] = c;
+    }
+
+  /* Every line of k cells (horizontal, vertical, both diagonals) is
+   * listed for each of its cells. */
+  memset(n_lines, 0, sizeof(n_lines));
+  for (y = 0; y < n; ++y)
+    for (x = 0; x < m; ++x)
+      for (d = 0; d < 4; ++d) {
+        int ex = x + (k - 1) * dx[d], ey = y + (k - 1) * dy[d];
+        uint64_t mask = 0;
+        if (ex >= m || ey < 0 || ey >= n) continue;
+        for (i = 0; i < k; ++i)
+          mask |= 1ULL << ((y + i * dy[d]) * m + x + i * dx[d]);
+        for (i = 0; i < k; ++i) {
+          c = (y + i * dy[d]) * m + x + i * dx[d];
+          lines[c][n_lines[c]++] = mask;
+        }
+      }
+
+  /* Stable insertion sort by distance */
+  for (i = 1; i < cells; ++i) {
+    unsigned char o = order[i];
+    for (s = i; s > 0 && dist[order[s - 1]] > dist[o]; --s) order[s] = order[s - 1];
+    order[s] = o;
+  }
+}
+
+void play(board_t *b, int c) {
+  int p = b->count & 1, s;
+
+  b->stones[p] |= 1ULL << c;
+  for (s = 0; s < n_syms; ++s) b->hash[s] ^= zobrist[sym[s][c]][p];
+  ++b->count;
+}
+
+void undo(board_t *b, int c) {
+  int p = --b->count & 1, s;
+
+  b->stones[p] &= ~(1ULL << c);
+  for (s = 0; s < n_syms; ++s) b->hash[s] ^= zobrist[sym[s][c]][p];
+}
+
+int is_free(const board_t *b, int c) {
+  return !((b->stones[0] | b->stones[1]) >> c & 1);
+}
+
+/* Would a stone on c complete a line of stones? */
+int completes(uint64_t stones, int c) {
+  int i;
+
+  stones |= 1ULL << c;
+  for (i = 0; i < n_lines[c]; ++i)
+    if ((stones & lines[c][i]) == lines[c][i]) return 1;
+  return 0;
+}
+
+/* Did the stone just played on c complete a line? */
+int wins(const board_t *b, int c) {
+  return completes(b->stones[(b->count - 1) & 1], c);
+}
+
+/* Key of the position and the symmetry that gives it */
+uint64_t canonical(const board_t *b, int *s_min) {
+  uint64_t key = b->hash[0];
+  int s;
+
+  *s_min = 0;
+  for (s = 1; s < n_syms; ++s)
+    if (b->hash[s] < key) {
+      key = b->hash[s];
+      *s_min = s;
+    }
+  return key ? key : 1;  /* 0 marks a free slot */
+}
+
+/* A score one move further away: wins and losses lose a point */
+int toward_zero(int v) {
+  return v > 0 ? v - 1 : v < 0 ? v + 1 : 0;
+}
+
+/* --- Transposition table --- */
+
+typedef struct {
+  _Atomic uint64_t check;  /* key ^ data */
+  _Atomic uint64_t data;   /* value, bound, empty cells */
+} tt_entry;
+
+tt_entry *tt;
+uint64_t tt_mask;
+int tt_bits = 22;
+
+/* Two slots per bucket: the first keeps the bigger subtree, the second
+ * takes whatever comes. */
+int tt_probe(uint64_t key, int *value, int *bound) {
+  tt_entry *e = &tt[key & tt_mask & ~1ULL];
+  int i;
+
+  for (i = 0; i < 2; ++i) {
+    uint64_t d = atomic_load_explicit(&e[i].data, memory_order_relaxed);
+    uint64_t c = atomic_load_explicit(&e[i].check, memory_order_relaxed);
+    if ((c ^ d) == key) {
+      *value = (signed char)(d & 0xff);
+      *bound = d >> 8 & 3;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void tt_store(uint64_t key, int value, int bound, int empty) {
+  tt_entry *e = &tt[key & tt_mask & ~1ULL];
+  uint64_t d = (uint64_t)(unsigned char)value | (uint64_t)bound << 8 |
+               (uint64_t)empty << 16;
+  uint64_t d0 = atomic_load_explicit(&e[0].data, memory_order_relaxed);
+  uint64_t c0 = atomic_load_explicit(&e[0].check, memory_order_relaxed);
+
+  if ((c0 ^ d0) != key && (int)(d0 >> 16) > empty) ++e;
+  atomic_store_explicit(&e->data, d, memory_order_relaxed);
+  atomic_store_explicit(&e->check, key ^ d, memory_order_relaxed);
+}
+
+/* --- Search --- */
+
+typedef struct worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  board_t *tasks;
+  int head, tail, cap;    /* owner works at tail, thieves take head */
+  unsigned long long nodes;
+  int id;
+} worker_t;
+
+/* Negamax with fail-soft alpha-beta. A child's score is toward_zero()
+ * of its negated score, which moves a bound by at most 1, so the child
+ * is searched with the window widened by 1 on each side. */
+int search(worker_t *w, board_t *b, int alpha, int beta) {
+  int alpha0, best = -INF, forced = -1, threats = 0, i, c, v, bound, s;
+  uint64_t key;
+
+  ++w->nodes;
+  if (b->count == cells) return 0;
+
+  key = canonical(b, &s);
+  if (tt_probe(key, &v, &bound)) {
+    if (bound == EXACT) return v;
+    if (bound == LOWER && v > alpha) alpha = v;
+    if (bound == UPPER && v < beta) beta = v;
+    if (alpha >= beta) return v;
+  }
+  alpha0 = alpha;
+
+  /* A win on the spot beats everything else. Otherwise two open wins
+   * of the opponent lose, and one has to be blocked. */
+  for (i = 0; i < cells; ++i) {
+    c = order[i];
+    if (!is_free(b, c)) continue;
+    if (completes(b->stones[b->count & 1], c)) return win_score - 1;
+    if (completes(b->stones[~b->count & 1], c)) {
+      if (forced >= 0) threats = 2;
+      forced = c;
+    }
+  }
+  if (threats > 1) return -(win_score - 2);
+
+  for (i = 0; i < cells; ++i) {
+    c = order[i];
+    if (!is_free(b, c) || (forced >= 0 && c != forced)) continue;
+    play(b, c);
+    v = toward_zero(-search(w, b, -(beta + 1), -(alpha - 1)));
+    undo(b, c);
+    if (v > best) best = v;
+    if (best > alpha) alpha = best;
+    if (alpha >= beta) break;
+  }
+
+  tt_store(key, best, best <= alpha0 ? UPPER : best >= beta ? LOWER : EXACT,
+           cells - b->count);
+  return best;
+}
+
+/* --- Book --- */
+
+/* Exact scores of all moves of each book position, indexed by cell of
+ * the canonical orientation (OCCUPIED for taken cells). */
+_Atomic uint64_t *book_keys;
+signed char *book_vals;
+uint64_t book_mask;
+int book_bits = 20;
+atomic_long book_used;
+
+/* Slot of key; with claim, a missing key is added and *added set. */
+long book_find(uint64_t key, int claim, int *added) {
+  uint64_t i = key & book_mask;
+
+  for (;;) {
+    uint64_t cur = atomic_load(&book_keys[i]);
+    if (cur == key) return i;
+    if (!cur) {
+      if (!claim) return -1;
+      if (atomic_compare_exchange_strong(&book_keys[i], &cur, key)) {
+        if (atomic_fetch_add(&book_used, 1) > (long)(book_mask >> 1)) {
+          fputs("Book table full, raise -B.\n", stderr);
+          exit(2);
+        }
+        *added = 1;
+        return i;
+      }
+      if (cur == key) return i;
+    }
+    i = (i + 1) & book_mask;
+  }
+}
+
+/* --- Work stealing --- */
+
+worker_t workers[MAX_THREADS];
+int n_workers;
+atomic_long pending;  /* tasks queued or running */
+
+void push(worker_t *w, const board_t *b) {
+  atomic_fetch_add(&pending, 1);
+  pthread_mutex_lock(&w->lock);
+  if (w->tail == w->cap) {
+    w->cap = w->cap ? 2 * w->cap : 256;
+    w->tasks = realloc(w->tasks, w->cap * sizeof(board_t));
+    if (!w->tasks) {
+      fputs("Out of memory.\n", stderr);
+      exit(2);
+    }
+  }
+  w->tasks[w->tail++] = *b;
+  pthread_mutex_unlock(&w->lock);
+}
+
+int pop(worker_t *w, board_t *b) {
+  int ok = 0;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->tail > w->head) {
+    *b = w->tasks[--w->tail];
+    ok = 1;
+  }
+  if (w->tail == w->head) w->head = w->tail = 0;
+  pthread_mutex_unlock(&w->lock);
+  return ok;
+}
+
+int steal(worker_t *self, board_t *b) {
+  int i, ok = 0;
+
+  for (i = 1; i < n_workers && !ok; ++i) {
+    worker_t *v = &workers[(self->id + i) % n_workers];
+    pthread_mutex_lock(&v->lock);
+    if (v->tail > v->head) {
+      *b = v->tasks[v->head++];
+      ok = 1;
+    }
+    pthread_mutex_unlock(&v->lock);
+  }
+  return ok;
+}
+
+/* One book position: exact scores of all its moves, then its
+ * successors as new tasks. */
+void run_task(worker_t *w, board_t *b) {
+  signed char vals[MAX_CELLS];
+  int c, s, added;
+  long slot = book_find(canonical(b, &s), 0, &added);
+
+  for (c = 0; c < cells; ++c) {
+    if (!is_free(b, c)) {
+      vals[sym[s][c]] = OCCUPIED;
+      continue;
+    }
+    play(b, c);
+    if (wins(b, c)) vals[sym[s][c]] = win_score - 1;
+    else if (b->count == cells) vals[sym[s][c]] = 0;
+    else vals[sym[s][c]] = toward_zero(-search(w, b, -INF, INF));
+    undo(b, c);
+  }
+  memcpy(book_vals + slot * cells, vals, cells);
+
+  if (b->count + 1 >= depth_limit) return;
+  for (c = 0; c < cells; ++c) {
+    if (!is_free(b, c)) continue;
+    play(b, c);
+    if (!wins(b, c) && b->count < cells) {
+      added = 0;
+      book_find(canonical(b, &s), 1, &added);
+      if (added) push(w, b);
+    }
+    undo(b, c);
+  }
+}
+
+void *work(void *arg) {
+  worker_t *w = arg;
+  board_t b;
+
+  for (;;) {
+    if (pop(w, &b) || steal(w, &b)) {
+      run_task(w, &b);
+      atomic_fetch_sub(&pending, 1);
+    } else if (!atomic_load(&pending)) {
+      break;
+    } else {
+      sched_yield();
+    }
+  }
+  return 0;
+}
+
+double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Solve the book with threads threads; returns the wall time */
+double solve(int threads, unsigned long long *nodes) {
+  board_t root;
+  double t;
+  int i, s, added = 0;
+
+  memset(tt, 0, (tt_mask + 1) * sizeof(tt_entry));
+  memset((void *)book_keys, 0, (book_mask + 1) * sizeof(*book_keys));
+  atomic_store(&book_used, 0);
+  atomic_store(&pending, 0);
+
+  memset(&root, 0, sizeof(root));
+  n_workers = threads;
+  for (i = 0; i < threads; ++i) {
+    workers[i].id = i;
+    workers[i].nodes = 0;
+    workers[i].head = workers[i].tail = 0;
+  }
+  book_find(canonical(&root, &s), 1, &added);
+  push(&workers[0], &root);
+
+  t = now_sec();
+  for (i = 1; i < threads; ++i)
+    pthread_create(&workers[i].thread, 0, work, &workers[i]);
+  work(&workers[0]);
+  for (i = 1; i < threads; ++i) pthread_join(workers[i].thread, 0);
+  t = now_sec() - t;
+
+  for (*nodes = 0, i = 0; i < threads; ++i) *nodes += workers[i].nodes;
+  return t;
+}
+
+/* Best move of position b from the book: the first cell (in b's own
+ * numbering) with the highest score, as genai picks it */
+int book_move(const board_t *b) {
+  int s, c, best = NO_MOVE, added;
+  long slot = book_find(canonical(b, &s), 0, &added);
+  const signed char *vals;
+
+  if (slot < 0) return NO_MOVE;
+  vals = book_vals + slot * cells;
+  for (c = 0; c < cells; ++c) {
+    int v = vals[sym[s][c]];
+    if (v == OCCUPIED) continue;
+    if (best == NO_MOVE || v > vals[sym[s][best]]) best = c;
+  }
+  return best;
+}
+
+/* --- Output --- */
+
+unsigned char *table, *reachable;
+unsigned pow3[MAX_TABLE_CELLS + 1];
+
+/* Same walk as mark_reachable() in genai.c, limited to the book */
+void mark_reachable(board_t *b, unsigned idx, int won) {
+  int c;
+
+  if (reachable[idx]) return;
+  reachable[idx] = 1;
+  if (won || b->count >= depth_limit) return;
+  table[idx] = book_move(b);
+
+  for (c = 0; c < cells; ++c) {
+    if (!is_free(b, c)) continue;
+    play(b, c);
+    mark_reachable(b, idx + pow3[c] * (2 - (b->count & 1)), wins(b, c));
+    undo(b, c);
+  }
+}
+
+void write_table(FILE *out, const char *name) {
+  board_t root;
+  int i, n_pos, n_bytes, n_reach = 0;
+
+  for (i = 0, pow3[0] = 1; i < cells; ++i) pow3[i + 1] = pow3[i] * 3;
+  n_pos = pow3[cells];
+  n_bytes = (n_pos + 1) / 2;
+  table = malloc(n_pos);
+  reachable = calloc(n_pos, 1);
+  if (!table || !reachable) {
+    fputs("Out of memory.\n", stderr);
+    exit(2);
+  }
+  memset(table, NO_MOVE, n_pos);
+
+  memset(&root, 0, sizeof(root));
+  mark_reachable(&root, 0, 0);
+  for (i = 0; i < n_pos; ++i) if (reachable[i]) ++n_reach;
+
+  fprintf(out, "/* %d reachable positions, move = cell y*%d+x, 0x%x = none */\n",
+          n_reach, m, NO_MOVE);
+  fprintf(out, "const unsigned char %s[%d] = {\n", name, n_bytes);
+
+  for (i = 0; i < n_bytes; ++i) {
+    unsigned lo = 2*i, hi = 2*i + 1;
+    unsigned m_lo = table[lo], m_hi = hi < (unsigned)n_pos ? table[hi] : NO_MOVE;
+
+    if (i % 16 == 0) fputs("  ", out);
+    fprintf(out, "0x%02x", (m_hi << 4) | m_lo);
+    if (i != n_bytes - 1) fputc(',', out);
+    if (i % 16 == 15 || i == n_bytes - 1) fputc('\n', out); else fputc(' ', out);
+  }
+
+  fputs("};\n", out);
+  free(table);
+  free(reachable);
+}
+
+void report(int threads, double t, unsigned long long nodes, double t1) {
+  board_t root;
+  int c, best = -INF, added, s;
+  const signed char *vals;
+
+  memset(&root, 0, sizeof(root));
+  vals = book_vals + book_find(canonical(&root, &s), 0, &added) * cells;
+  for (c = 0; c < cells; ++c) if (vals[c] != OCCUPIED && vals[c] > best) best = vals[c];
+
+  printf("solve %dx%dk%d threads=%d positions=%ld value=%d result=%s",
+         m, n, k, threads, atomic_load(&book_used), best,
+         best > 0 ? "first" : best < 0 ? "second" : "draw");
+  if (best) printf("+%d", win_score - (best > 0 ? best : -best));
+  printf(" nodes=%llu time_ms=%.1f nodes_per_s=%.0f speedup=%.2f\n",
+         nodes, t * 1e3, t > 0 ? nodes / t : 0, t > 0 ? t1 / t : 0);
+}
+
+void usage(void) {
+  fputs("Usage: mnksolve [-m cols] [-n rows] [-k line] [-d plies] [-j threads]\n"
+        "                [-S] [-T bits] [-B bits] [-o out.inc [-s name]]\n"
+        "  -d  book depth: positions with fewer stones are solved\n"
+        "      (default: all with -o, else 1 = the empty board)\n"
+        "  -j  threads (default: all cores), -S: 1, 2, 4, ... up to -j\n"
+        "  -T  transposition table entries as a power of 2 (default 22)\n"
+        "  -B  book entries as a power of 2 (default 20)\n"
+        "  -o  move table for the cart (boards of at most 15 cells)\n",
+        stderr);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *out_name = 0, *sym_name = "ai_moves";
+  int threads = sysconf(_SC_NPROCESSORS_ONLN), scaling = 0, i, t;
+  unsigned long long nodes;
+  double time1 = 0, time;
+
+  for (i = 1; i < argc; ++i) {
+    const char *opt = argv[i];
+
+    if (!strcmp(opt, "-S")) { scaling = 1; continue; }
+    if (i + 1 >= argc) usage();
+    if (!strcmp(opt, "-m")) m = atoi(argv[++i]);
+    else if (!strcmp(opt, "-n")) n = atoi(argv[++i]);
+    else if (!strcmp(opt, "-k")) k = atoi(argv[++i]);
+    else if (!strcmp(opt, "-d")) depth_limit = atoi(argv[++i]);
+    else if (!strcmp(opt, "-j")) threads = atoi(argv[++i]);
+    else if (!strcmp(opt, "-T")) tt_bits = atoi(argv[++i]);
+    else if (!strcmp(opt, "-B")) book_bits = atoi(argv[++i]);
+    else if (!strcmp(opt, "-o")) out_name = argv[++i];
+    else if (!strcmp(opt, "-s")) sym_name = argv[++i];
+    else usage();
+  }
+
+  if (m < 1 || n < 1 || m * n > MAX_CELLS || k < 1 || k > MAX_K ||
+      (k > m && k > n) || threads < 1 || threads > MAX_THREADS ||
+      tt_bits < 4 || tt_bits > 32 || book_bits < 4 || book_bits > 28) usage();
+  if (out_name && m * n > MAX_TABLE_CELLS) {
+    fprintf(stderr, "A move table needs a board of at most %d cells.\n",
+            MAX_TABLE_CELLS);
+    return 2;
+  }
+  if (!depth_limit) depth_limit = out_name ? m * n : 1;
+
+  setup();
+  tt_mask = (1ULL << tt_bits) - 1;
+  book_mask = (1ULL << book_bits) - 1;
+  tt = malloc((tt_mask + 1) * sizeof(tt_entry));
+  book_keys = malloc((book_mask + 1) * sizeof(*book_keys));
+  book_vals = malloc((book_mask + 1) * cells);
+  if (!tt || !book_keys || !book_vals) {
+    fputs("Out of memory.\n", stderr);
+    return 2;
+  }
+  for (i = 0; i < MAX_THREADS; ++i) pthread_mutex_init(&workers[i].lock, 0);
+
+  for (t = scaling ? 1 : threads; ; t = t * 2 < threads ? t * 2 : threads) {
+    time = solve(t, &nodes);
+    if (!time1) time1 = time;
+    report(t, time, nodes, scaling ? time1 : time);
+    if (t == threads) break;
+  }
+
+  if (out_name) {
+    FILE *f_out = fopen(out_name, "w");
+
+    if (!f_out) {
+      fputs("Could not open output file.\n", stderr);
+      return 2;
+    }
+    write_table(f_out, sym_name);
+    fclose(f_out);
+  }
+
+  return 0;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cart.h"
+#include "script.h"
+
+/* One segment per line: "<frames> <buttons>", buttons being "none" or
+ * names joined by '+' (up, down, left, right, a, b, select, start).
+ * '#' starts a comment. */
+void read_script(const char *path, struct script_seg *segs, int *n_segs, int max) {
+  FILE *in = fopen(path, "r");
+  char line[256], buttons[128];
+  int n = 0;
+
+  if (!in) {
+    fprintf(stderr, "Could not open %s.\n", path);
+    exit(2);
+  }
+
+  while (fgets(line, sizeof(line), in)) {
+    unsigned frames;
+    char *p, *tok;
+    struct script_seg *s;
+
+    ++n;
+    if ((p = strchr(line, '#'))) *p = 0;
+    if (sscanf(line, "%u %127s", &frames, buttons) != 2) continue;
+
+    if (*n_segs == max) {
+      fputs("Script too long.\n", stderr);
+      exit(2);
+    }
+    s = &segs[(*n_segs)++];
+    s->line = n;
+    s->frames = frames;
+    s->buttons = 0;
+
+    for (tok = strtok(buttons, "+"); tok; tok = strtok(0, "+")) {
+      if (!strcmp(tok, "none")) continue;
+      else if (!strcmp(tok, "right")) s->buttons |= J_RIGHT;
+      else if (!strcmp(tok, "left")) s->buttons |= J_LEFT;
+      else if (!strcmp(tok, "up")) s->buttons |= J_UP;
+      else if (!strcmp(tok, "down")) s->buttons |= J_DOWN;
+      else if (!strcmp(tok, "a")) s->buttons |= J_A;
+      else if (!strcmp(tok, "b")) s->buttons |= J_B;
+      else if (!strcmp(tok, "select")) s->buttons |= J_SELECT;
+      else if (!strcmp(tok, "start")) s->buttons |= J_START;
+      else {
+        fprintf(stderr, "%s:%d: unknown button '%s'.\n", path, n, tok);
+        exit(2);
+      }
+    }
+  }
+  fclose(in);
+}
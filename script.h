@@ -0,0 +1,15 @@
+/* Input scripts for gbbench and cart_host (see bench.inp and
+ * script.c). */
+
+/* One script line: hold buttons (J_* bits) for frames frames */
+struct script_seg {
+  int line;
+  unsigned frames;
+  unsigned char buttons;
+};
+
+/* Appends the lines of path to segs, which holds *n_segs of max
+ * segments. Exits with status 2 if the file cannot be read, a button
+ * name is unknown or the script does not fit. */
+void read_script(const char *path, struct script_seg *segs, int *n_segs,
+                 int max);